@@ -19,13 +19,18 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/vfs.h>    /* or <sys/statfs.h> */
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef __GNU_LIBRARY__
@@ -38,6 +43,9 @@
 enum {
 	INTERACTIVE	= 1,
 	VERBOSE		= (1 << 1),
+	RECURSIVE	= (1 << 2),
+	STDIN		= (1 << 3),
+	SUMMARY		= (1 << 4)
 };
 
 static struct option opts[] __attribute__((unused)) = {
@@ -48,6 +56,14 @@ static struct option opts[] __attribute__((unused)) = {
 	{"overwrite-lower",	no_argument,		NULL,	'o'},
 	{"allow-ro-lower",	no_argument,		NULL,	'r'},
 	{"allow-ro-upper",	no_argument,		NULL,	'R'},
+	{"recursive",		no_argument,		NULL,	'D'},
+	{"bytes-per-sec",	required_argument,	NULL,	't'},
+	{"files-per-sec",	required_argument,	NULL,	'f'},
+	{"io-pressure",		required_argument,	NULL,	'p'},
+	{"null",		no_argument,		NULL,	'0'},
+	{"sort-window",		required_argument,	NULL,	'w'},
+	{"summary",		no_argument,		NULL,	'S'},
+	{"interval",		required_argument,	NULL,	'I'},
 	{"verbose",		no_argument,		NULL,	'v'},
 	{"version",		no_argument,		NULL,	'V'},
 	{"help",		no_argument,		NULL,	'h'},
@@ -57,7 +73,7 @@ static struct option opts[] __attribute__((unused)) = {
 	{NULL,			no_argument,		NULL,  0}
 };
 
-#define OPTS_FORM	"b:B:ikorRvVh" "ds"
+#define OPTS_FORM	"b:B:ikorRDt:f:p:0w:SI:vVh" "ds"
 
 static __attribute__((unused)) void usage(void)
 {
@@ -66,6 +82,8 @@ static __attribute__((unused)) void usage(void)
 		"move-down the specified file (an opposite action of copy-up)\n"
 		"from the highest branch where the file exist to the next\n"
 		"lower writable branch.\n"
+		"with -D, the files under the specified dir are moved-down.\n"
+		"with -0, the NUL-delimited filenames are read from stdin.\n"
 		"options:\n"
 		"-b | --lower-branch-id brid\n"
 		"-B | --upper-branch-id brid\n"
@@ -74,6 +92,14 @@ static __attribute__((unused)) void usage(void)
 		"-o | --overwrite-lower\n"
 		"-r | --allow-ro-lower\n"
 		"-R | --allow-ro-upper\n"
+		"-D | --recursive\n"
+		"-t | --bytes-per-sec bytes[KMG]\n"
+		"-f | --files-per-sec num\n"
+		"-p | --io-pressure percent\n"
+		"-0 | --null\n"
+		"-w | --sort-window num\n"
+		"-S | --summary\n"
+		"-I | --interval sec\n"
 		"-v | --verbose\n"
 		"-V | --version\n"
 		AuVersion "\n", program_invocation_short_name);
@@ -91,6 +117,35 @@ static __attribute__((unused)) long cvt(char *str)
 	return ret;
 }
 
+static long long cvt_size(char *str)
+{
+	long long ret;
+	char *e;
+
+	errno = 0;
+	ret = strtoll(str, &e, 10);
+	if (errno || ret < 0)
+		return -1;
+
+	switch (toupper(*e)) {
+	case 'G':
+		ret <<= 10;
+		/*FALLTHROUGH*/
+	case 'M':
+		ret <<= 10;
+		/*FALLTHROUGH*/
+	case 'K':
+		ret <<= 10;
+		/*FALLTHROUGH*/
+	case 0:
+		break;
+	default:
+		errno = EINVAL;
+		ret = -1;
+	}
+	return ret;
+}
+
 static __attribute__((unused)) void pr_stbr(struct aufs_stbr *stbr)
 {
 	printf("b%d %d%%(%llu/%llu), %d%%(%llu/%llu) free\n",
@@ -116,16 +171,700 @@ static __attribute__((unused)) void pr_stbr(struct aufs_stbr *stbr)
 			exit(errno);					\
 	} while (0)
 
+static unsigned int user_flags;
+static struct aufs_mvdown mvdown = {
+	.flags = 0
+};
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * pacing the move-down.
+ * a token bucket for bytes and files per second each. a file larger than
+ * the rate puts the bucket into debt, and the next file waits until it is
+ * paid.
+ */
+struct au_bucket {
+	double rate, tokens;
+	struct timespec last;
+};
+
+static struct au_bucket bkt_bytes, bkt_files;
+
+static double ts_diff(struct timespec *a, struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void au_sleep(double sec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = sec;
+	ts.tv_nsec = (sec - ts.tv_sec) * 1e9;
+	while (nanosleep(&ts, &ts) && errno == EINTR)
+		;
+}
+
+static void bkt_take(struct au_bucket *b, double n)
+{
+	struct timespec now;
+
+	if (!b->rate)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (b->last.tv_sec || b->last.tv_nsec) {
+		b->tokens += ts_diff(&now, &b->last) * b->rate;
+		/* allow the burst for a second */
+		if (b->tokens > b->rate)
+			b->tokens = b->rate;
+	} else
+		b->tokens = b->rate;
+	b->last = now;
+	if (b->tokens < 0) {
+		au_sleep(-b->tokens / b->rate);
+		b->tokens = 0;
+		clock_gettime(CLOCK_MONOTONIC, &b->last);
+	}
+	b->tokens -= n;
+}
+
+/*
+ * adaptive mode.
+ * while "some avg10" of the io pressure stall information exceeds the
+ * threshold, sleep with the exponential backoff. the kernel updates avg10
+ * every 2 seconds, so we don't read it more than once a second.
+ */
+#define PSI_IO		"/proc/pressure/io"
+static int psi_threshold;
+static struct timespec psi_last;
+
+static double psi_io(void)
+{
+	double avg;
+	FILE *fp;
+
+	avg = -1;
+	fp = fopen(PSI_IO, "r");
+	if (fp) {
+		if (fscanf(fp, "some avg10=%lf", &avg) != 1)
+			avg = -1;
+		fclose(fp);
+	}
+	return avg;
+}
+
+static void psi_wait(void)
+{
+	double avg, backoff;
+	struct timespec now;
+
+	if (!psi_threshold)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ts_diff(&now, &psi_last) < 1)
+		return;
+
+	backoff = 0.25;
+	while (1) {
+		avg = psi_io();
+		if (avg < 0) {
+			fprintf(stderr, "%s is unavailable, --io-pressure is"
+				" ignored\n", PSI_IO);
+			fflush(stderr);
+			psi_threshold = 0;
+			break;
+		}
+		if (avg <= psi_threshold)
+			break;
+		/* stdout is for the summary */
+		if (user_flags & VERBOSE) {
+			fprintf(stderr, "io pressure %.2f%%, wait %.2fs\n",
+				avg, backoff);
+			fflush(stderr);
+		}
+		au_sleep(backoff);
+		if (backoff < 8)
+			backoff *= 2;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &psi_last);
+}
+
+static void throttle(struct stat *st)
+{
+	psi_wait();
+	bkt_take(&bkt_files, 1);
+	if (bkt_bytes.rate)
+		bkt_take(&bkt_bytes, st->st_size);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * summary of the run, printed as a JSON object per line periodically and at
+ * exit. the free blocks/inodes of the branches before the run are taken by
+ * statfs(2) of the branch roots just before the first move-down (or the
+ * first AUFS_MVDOWN_STFS when AUFS_CTL_BRINFO fails), and the ones after it
+ * are reported by AUFS_MVDOWN_STFS for the last move-down.
+ * the latency histogram has the power-of-2 buckets in microseconds.
+ */
+#define SMRY_NHIST	32
+#define SMRY_NERRNO	256
+
+struct au_smry_br {
+	int16_t			bindex, brid;
+	struct aufs_stfs	before, after;
+};
+
+static struct {
+	struct timespec		start, last;
+	int			interval;
+
+	unsigned long long	files, bytes, failed;
+	unsigned long long	au_errno[EAU_Last], sys_errno[SMRY_NERRNO];
+
+	unsigned long long	hist[SMRY_NHIST], nlat;
+	double			lat_min, lat_max, lat_sum;
+
+	int			nbr, snap;
+	struct au_smry_br	*br;
+} smry;
+
+/* statfs(2) all the branches of the aufs which fd belongs to */
+static void smry_snap(int fd)
+{
+	int nbr, i, e;
+	union aufs_brinfo *brinfo;
+	struct au_smry_br *br;
+	struct statfs stfs;
+
+	smry.snap = 1;
+	e = errno;
+	nbr = ioctl(fd, AUFS_CTL_BRINFO, NULL);
+	if (nbr <= 0)
+		goto out;
+	brinfo = malloc(nbr * sizeof(*brinfo));
+	br = calloc(nbr, sizeof(*br));
+	if (!brinfo || !br || ioctl(fd, AUFS_CTL_BRINFO, brinfo))
+		goto out_free;
+
+	for (i = 0; i < nbr; i++) {
+		br[i].bindex = i;
+		br[i].brid = brinfo[i].id;
+		if (!statfs(brinfo[i].path, &stfs)) {
+			br[i].before.f_blocks = stfs.f_blocks;
+			br[i].before.f_bavail = stfs.f_bavail;
+			br[i].before.f_files = stfs.f_files;
+			br[i].before.f_ffree = stfs.f_ffree;
+		}
+		br[i].after = br[i].before;
+	}
+	smry.br = br;
+	smry.nbr = nbr;
+	br = NULL;
+
+ out_free:
+	free(br);
+	free(brinfo);
+ out:
+	/* failing in it is not an error */
+	errno = e;
+}
+
+static void smry_stbr(struct aufs_stbr *stbr)
+{
+	int i;
+	struct au_smry_br *br;
+
+	for (i = 0; i < smry.nbr; i++)
+		if (smry.br[i].bindex == stbr->bindex) {
+			smry.br[i].brid = stbr->brid;
+			smry.br[i].after = stbr->stfs;
+			return;
+		}
+
+	br = realloc(smry.br, sizeof(*br) * (smry.nbr + 1));
+	if (!br)
+		return; /* ignore */
+	smry.br = br;
+	br += smry.nbr++;
+	br->bindex = stbr->bindex;
+	br->brid = stbr->brid;
+	br->before = stbr->stfs;
+	br->after = stbr->stfs;
+}
+
+/* count a failure, mvdown.au_errno or errno tells the reason */
+static void smry_failed(void)
+{
+	smry.failed++;
+	if (0 < mvdown.au_errno && mvdown.au_errno < EAU_Last)
+		smry.au_errno[(int)mvdown.au_errno]++;
+	else if (0 < errno && errno < SMRY_NERRNO)
+		smry.sys_errno[errno]++;
+}
+
+static void smry_add(int err, struct stat *st, struct timespec *t0)
+{
+	int i;
+	double lat;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lat = ts_diff(&now, t0) * 1e6;
+	if (!smry.lat_sum || lat < smry.lat_min)
+		smry.lat_min = lat;
+	if (lat > smry.lat_max)
+		smry.lat_max = lat;
+	smry.lat_sum += lat;
+	smry.nlat++;
+	for (i = 0; i < SMRY_NHIST - 1 && (1ULL << (i + 1)) <= lat; i++)
+		;
+	smry.hist[i]++;
+
+	if (!err) {
+		smry.files++;
+		smry.bytes += st->st_size;
+		if (!(mvdown.flags & AUFS_MVDOWN_STFS_FAILED)) {
+			smry_stbr(mvdown.stbr + AUFS_MVDOWN_UPPER);
+			smry_stbr(mvdown.stbr + AUFS_MVDOWN_LOWER);
+		}
+	} else
+		smry_failed();
+}
+
+static void smry_print(int final)
+{
+	int i;
+	double elapsed;
+	char *sep;
+	struct timespec now;
+	struct au_smry_br *br;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = ts_diff(&now, &smry.start);
+	printf("{\"final\": %s, \"elapsed\": %.3f,"
+	       " \"files\": %llu, \"bytes\": %llu,"
+	       " \"files_per_sec\": %.1f, \"bytes_per_sec\": %.1f",
+	       final ? "true" : "false", elapsed, smry.files, smry.bytes,
+	       elapsed ? smry.files / elapsed : 0,
+	       elapsed ? smry.bytes / elapsed : 0);
+
+	printf(", \"failed\": {\"total\": %llu", smry.failed);
+	for (i = 1; i < EAU_Last; i++)
+		if (smry.au_errno[i])
+			printf(", \"%s\": %llu", au_errlist[i], smry.au_errno[i]);
+	for (i = 1; i < SMRY_NERRNO; i++)
+		if (smry.sys_errno[i])
+			printf(", \"%s\": %llu", strerror(i), smry.sys_errno[i]);
+	printf("}");
+
+	printf(", \"latency_us\": {\"min\": %.1f, \"max\": %.1f,"
+	       " \"avg\": %.1f, \"hist\": {",
+	       smry.lat_min, smry.lat_max,
+	       smry.nlat ? smry.lat_sum / smry.nlat : 0);
+	sep = "";
+	for (i = 0; i < SMRY_NHIST; i++)
+		if (smry.hist[i]) {
+			printf("%s\"%llu\": %llu", sep, 1ULL << (i + 1),
+			       smry.hist[i]);
+			sep = ", ";
+		}
+	printf("}}");
+
+	printf(", \"branches\": [");
+	sep = "";
+	for (i = 0; i < smry.nbr; i++) {
+		br = smry.br + i;
+		printf("%s{\"bindex\": %d, \"brid\": %d,"
+		       " \"blocks\": %llu, \"bavail\": [%llu, %llu],"
+		       " \"files\": %llu, \"ffree\": [%llu, %llu]}",
+		       sep, br->bindex, br->brid,
+		       (unsigned long long)br->after.f_blocks,
+		       (unsigned long long)br->before.f_bavail,
+		       (unsigned long long)br->after.f_bavail,
+		       (unsigned long long)br->after.f_files,
+		       (unsigned long long)br->before.f_ffree,
+		       (unsigned long long)br->after.f_ffree);
+		sep = ", ";
+	}
+	printf("]}\n");
+	fflush(stdout);
+	smry.last = now;
+}
+
+static void smry_tick(void)
+{
+	struct timespec now;
+
+	if (!smry.interval)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (ts_diff(&now, &smry.last) >= smry.interval)
+		smry_print(/*final*/0);
+}
+
+static void smry_fin(void)
+{
+	smry_print(/*final*/1);
+}
+
+/*
+ * under --summary, the file failed before the ioctl is counted and skipped
+ * too. returns 1 to skip it, otherwise it doesn't return.
+ */
+#define AuMvDownSkip(mvdown, str) ({					\
+		if (!(user_flags & SUMMARY))				\
+			AuMvDownFin(mvdown, str);			\
+		(mvdown)->au_errno = 0;					\
+		smry_failed();						\
+		au_errno = 0;						\
+		au_perror(str);						\
+		smry_tick();						\
+		1;							\
+	})
+
+/* ---------------------------------------------------------------------- */
+
+static int ask(char *path)
+{
+	int c;
+
+	if (!(user_flags & INTERACTIVE))
+		return 1;
+
+	fprintf(stderr, "move down '%s'? ", path);
+	fflush(stderr);
+	c = fgetc(stdin);
+	c = toupper(c);
+	return c == 'Y';
+}
+
+static int do_mvdown(int fd, struct stat *st, char *path)
+{
+	int err;
+	struct stat s;
+	struct timespec t0;
+
+	if (!st && (bkt_bytes.rate || (user_flags & SUMMARY))) {
+		if (fstat(fd, &s) && AuMvDownSkip(&mvdown, path))
+			return close(fd);
+		st = &s;
+	}
+	throttle(st);
+	if ((user_flags & SUMMARY) && !smry.snap)
+		smry_snap(fd);
+
+	if (!(user_flags & SUMMARY))
+		err = ioctl(fd, AUFS_CTL_MVDOWN, &mvdown);
+	else {
+		mvdown.au_errno = 0;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		err = ioctl(fd, AUFS_CTL_MVDOWN, &mvdown);
+		smry_add(err, st, &t0);
+		smry_tick();
+		if (err) {
+			/* count it and continue */
+			au_errno = mvdown.au_errno;
+			au_perror(path);
+			return close(fd);
+		}
+	}
+	if (err)
+		AuMvDownFin(&mvdown, path);
+	if (user_flags & VERBOSE) {
+		char *u = "", *l = "";
+		if (mvdown.flags & AUFS_MVDOWN_ROLOWER_R)
+			l = "(RO)";
+		if (mvdown.flags & AUFS_MVDOWN_ROUPPER_R)
+			u = "(RO)";
+		printf("'%s' b%d(brid%d)%s --> b%d(brid%d)%s\n",
+		       path,
+		       mvdown.stbr[AUFS_MVDOWN_UPPER].bindex,
+		       mvdown.stbr[AUFS_MVDOWN_UPPER].brid,
+		       u,
+		       mvdown.stbr[AUFS_MVDOWN_LOWER].bindex,
+		       mvdown.stbr[AUFS_MVDOWN_LOWER].brid,
+		       l);
+		if (mvdown.flags & AUFS_MVDOWN_STFS) {
+			if (!(mvdown.flags & AUFS_MVDOWN_STFS_FAILED)) {
+				pr_stbr(mvdown.stbr + AUFS_MVDOWN_UPPER);
+				pr_stbr(mvdown.stbr + AUFS_MVDOWN_LOWER);
+			} else {
+				fprintf(stderr, "STFS failed, ignored\n");
+				fflush(stderr);
+			}
+		}
+	}
+	err = close(fd);
+	if (err)
+		AuMvDownFin(&mvdown, path);
+
+	return err;
+}
+
+/*
+ * move-down the single-linked regular files under the dir recursively,
+ * skipping whiteouts as aufhsm-list does.
+ * every entry is opened relative to its parent dir, and the path is built
+ * only for the messages.
+ * the dir fd is consumed.
+ */
+static int mvdown_dir(int dfd, char *path, int len, dev_t dev)
+{
+	int err, fd, l;
+	DIR *dp;
+	struct dirent *de;
+	struct stat st;
+	unsigned char type;
+	char *name;
+
+	err = 0;
+	dp = fdopendir(dfd);
+	if (!dp)
+		AuMvDownFin(&mvdown, path);
+	while (!err) {
+		errno = 0;
+		de = readdir(dp);
+		if (!de)
+			break;
+		name = de->d_name;
+		if (name[0] == '.'
+		    && (!name[1] || (name[1] == '.' && !name[2])))
+			continue;
+		if (!strncmp(name, AUFS_WH_PFX, AUFS_WH_PFX_LEN))
+			continue;
+
+		l = strlen(name);
+		if (len + l + 1 >= PATH_MAX) {
+			errno = ENAMETOOLONG;
+			AuMvDownFin(&mvdown, path);
+		}
+		path[len] = '/';
+		memcpy(path + len + 1, name, l + 1);
+
+		type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			err = fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW);
+			if (err && AuMvDownSkip(&mvdown, path)) {
+				err = 0;
+				path[len] = 0;
+				continue;
+			}
+			type = IFTODT(st.st_mode);
+		}
+
+		switch (type) {
+		case DT_DIR:
+			fd = openat(dfd, name,
+				    O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd < 0 && AuMvDownSkip(&mvdown, path))
+				break;
+			err = fstat(fd, &st);
+			if (err && AuMvDownSkip(&mvdown, path))
+				err = close(fd);
+			else if (st.st_dev == dev)
+				err = mvdown_dir(fd, path, len + l + 1, dev);
+			else
+				err = close(fd);
+			break;
+		case DT_REG:
+			fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW);
+			if (fd < 0 && AuMvDownSkip(&mvdown, path))
+				break;
+			err = fstat(fd, &st);
+			if (err && AuMvDownSkip(&mvdown, path))
+				err = close(fd);
+			else if (S_ISREG(st.st_mode)
+			    && st.st_nlink == 1
+			    && ask(path))
+				err = do_mvdown(fd, &st, path);
+			else
+				err = close(fd);
+			break;
+		}
+		path[len] = 0;
+	}
+	if (errno)
+		AuMvDownFin(&mvdown, path);
+
+	if (closedir(dp))
+		AuMvDownFin(&mvdown, path);
+
+	return err;
+}
+
+static int mvdown_tree(char *arg)
+{
+	int err, fd, l;
+	struct stat st;
+	char path[PATH_MAX];
+
+	fd = open(arg, O_RDONLY);
+	if (fd < 0 && AuMvDownSkip(&mvdown, arg))
+		return 0;
+	err = fstat(fd, &st);
+	if (err && AuMvDownSkip(&mvdown, arg))
+		return close(fd);
+	if (!S_ISDIR(st.st_mode)) {
+		if (ask(arg))
+			err = do_mvdown(fd, &st, arg);
+		else
+			err = close(fd);
+		goto out;
+	}
+
+	l = strlen(arg);
+	while (l > 1 && arg[l - 1] == '/')
+		l--;
+	if (l >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		AuMvDownFin(&mvdown, arg);
+	}
+	memcpy(path, arg, l);
+	path[l] = 0;
+	err = mvdown_dir(fd, path, l, st.st_dev);
+
+out:
+	return err;
+}
+
+static int mvdown_arg(char *arg)
+{
+	int fd;
+
+	if (user_flags & RECURSIVE)
+		return mvdown_tree(arg);
+
+	if (!ask(arg))
+		return 0;
+	fd = open(arg, O_RDONLY);
+	if (fd < 0 && AuMvDownSkip(&mvdown, arg))
+		return 0;
+	return do_mvdown(fd, NULL, arg);
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * the filenames from stdin, NUL-delimited as find -print0 generates.
+ * with --sort-window, every window of the entries is sorted by the parent
+ * dir and the inode number before moving-down, so that the lower branch
+ * allocates mostly sequentially and the upper frees in contiguous runs.
+ * the result of lstat(2) is used for sorting only.
+ */
+struct au_lent {
+	char *path;
+	int dlen;	/* length of the parent dir */
+	struct stat st;
+};
+
+static int lent_cmp(const void *_a, const void *_b)
+{
+	int ret, l;
+	const struct au_lent *a = _a, *b = _b;
+
+	l = a->dlen;
+	if (l > b->dlen)
+		l = b->dlen;
+	ret = memcmp(a->path, b->path, l);
+	if (!ret)
+		ret = a->dlen - b->dlen;
+	if (!ret)
+		ret = (a->st.st_ino > b->st.st_ino)
+			- (a->st.st_ino < b->st.st_ino);
+	return ret;
+}
+
+static int mvdown_window(struct au_lent *lent, int n)
+{
+	int err, fd, i;
+
+	err = 0;
+	qsort(lent, n, sizeof(*lent), lent_cmp);
+	for (i = 0; i < n; i++) {
+		/*
+		 * the file may be replaced after lstat(2), and the size is
+		 * taken from the opened one by do_mvdown().
+		 */
+		fd = open(lent[i].path, O_RDONLY | O_NOFOLLOW);
+		if (fd >= 0)
+			err = do_mvdown(fd, NULL, lent[i].path);
+		else
+			AuMvDownSkip(&mvdown, lent[i].path);
+		free(lent[i].path);
+	}
+
+	return err;
+}
+
+static int mvdown_stdin(int window)
+{
+	int err, n;
+	ssize_t l;
+	size_t sz;
+	char *line, *p;
+	struct au_lent *lent;
+
+	err = 0;
+	lent = NULL;
+	if (window && !(user_flags & RECURSIVE)) {
+		lent = malloc(sizeof(*lent) * window);
+		if (!lent)
+			AuMvDownFin(&mvdown, "stdin");
+	}
+	setvbuf(stdin, NULL, _IOFBF, 1 << 16); /* ignore */
+
+	n = 0;
+	line = NULL;
+	sz = 0;
+	while (1) {
+		errno = 0;
+		l = getdelim(&line, &sz, '\0', stdin);
+		if (l < 0)
+			break;
+		if (!*line)
+			continue;
+		if (!lent) {
+			err = mvdown_arg(line);
+			continue;
+		}
+
+		lent[n].path = line;
+		line = NULL;
+		sz = 0;
+		if (lstat(lent[n].path, &lent[n].st)
+		    && AuMvDownSkip(&mvdown, lent[n].path)) {
+			free(lent[n].path);
+			continue;
+		}
+		p = strrchr(lent[n].path, '/');
+		lent[n].dlen = p ? p - lent[n].path : 0;
+		if (++n == window) {
+			err = mvdown_window(lent, n);
+			n = 0;
+		}
+	}
+	if (errno)
+		AuMvDownFin(&mvdown, "stdin");
+	if (n)
+		err = mvdown_window(lent, n);
+	free(line);
+	free(lent);
+
+	return err;
+}
+
+/* ---------------------------------------------------------------------- */
+
 int main(int argc, char *argv[])
 {
-	int err, fd, i, c;
-	unsigned int user_flags;
-	struct aufs_mvdown mvdown = {
-		.flags = 0
-	};
+	int err, i, c, window;
 
 	err = 0;
 	user_flags = 0;
+	window = 0;
 	i = 0;
 	while ((c = getopt_long(argc, argv, OPTS_FORM, opts, &i)) != -1) {
 		switch (c) {
@@ -162,6 +901,56 @@ int main(int argc, char *argv[])
 		case 'R':
 			mvdown.flags |= AUFS_MVDOWN_ROUPPER;
 			break;
+		case 'D':
+			user_flags |= RECURSIVE;
+			break;
+		case 't':
+			bkt_bytes.rate = cvt_size(optarg);
+			if (bkt_bytes.rate < 0) {
+				err = -1;
+				perror(optarg);
+				goto out;
+			}
+			break;
+		case 'f':
+			bkt_files.rate = cvt(optarg);
+			if (bkt_files.rate < 0) {
+				err = -1;
+				perror(optarg);
+				goto out;
+			}
+			break;
+		case 'p':
+			psi_threshold = cvt(optarg);
+			if (psi_threshold < 0) {
+				err = -1;
+				perror(optarg);
+				goto out;
+			}
+			break;
+		case '0':
+			user_flags |= STDIN;
+			break;
+		case 'w':
+			window = cvt(optarg);
+			if (window < 0) {
+				err = -1;
+				perror(optarg);
+				goto out;
+			}
+			break;
+		case 'I':
+			smry.interval = cvt(optarg);
+			if (smry.interval < 0) {
+				err = -1;
+				perror(optarg);
+				goto out;
+			}
+			/*FALLTHROUGH*/
+		case 'S':
+			user_flags |= SUMMARY;
+			mvdown.flags |= AUFS_MVDOWN_STFS;
+			break;
 		case 'v':
 			user_flags |= VERBOSE;
 			break;
@@ -185,55 +974,29 @@ int main(int argc, char *argv[])
 	}
 
 	err = EINVAL;
-	if (optind == argc) {
+	if (optind == argc && !(user_flags & STDIN)) {
 		usage();
 		goto out;
 	}
+	if ((user_flags & (STDIN | INTERACTIVE)) == (STDIN | INTERACTIVE)) {
+		errno = err;
+		perror("--null and --interactive");
+		goto out;
+	}
 
-	for (i = optind; i < argc; i++) {
-		if (user_flags & INTERACTIVE) {
-			fprintf(stderr, "move down '%s'? ", argv[i]);
-			fflush(stderr);
-			c = fgetc(stdin);
-			c = toupper(c);
-			if (c != 'Y')
-				continue;
-		}
-		fd = open(argv[i], O_RDONLY);
-		if (fd < 0)
-			AuMvDownFin(&mvdown, argv[i]);
-		err = ioctl(fd, AUFS_CTL_MVDOWN, &mvdown);
-		if (err)
-			AuMvDownFin(&mvdown, argv[i]);
-		if (user_flags & VERBOSE) {
-			char *u = "", *l = "";
-			if (mvdown.flags & AUFS_MVDOWN_ROLOWER_R)
-				l = "(RO)";
-			if (mvdown.flags & AUFS_MVDOWN_ROUPPER_R)
-				u = "(RO)";
-			printf("'%s' b%d(brid%d)%s --> b%d(brid%d)%s\n",
-			       argv[i],
-			       mvdown.stbr[AUFS_MVDOWN_UPPER].bindex,
-			       mvdown.stbr[AUFS_MVDOWN_UPPER].brid,
-			       u,
-			       mvdown.stbr[AUFS_MVDOWN_LOWER].bindex,
-			       mvdown.stbr[AUFS_MVDOWN_LOWER].brid,
-			       l);
-			if (mvdown.flags & AUFS_MVDOWN_STFS) {
-				if (!(mvdown.flags & AUFS_MVDOWN_STFS_FAILED)) {
-					pr_stbr(mvdown.stbr + AUFS_MVDOWN_UPPER);
-					pr_stbr(mvdown.stbr + AUFS_MVDOWN_LOWER);
-				} else {
-					fprintf(stderr, "STFS failed, ignored\n");
-					fflush(stderr);
-				}
-			}
-		}
-		err = close(fd);
-		if (err)
-			AuMvDownFin(&mvdown, argv[i]);
+	if (user_flags & SUMMARY) {
+		clock_gettime(CLOCK_MONOTONIC, &smry.start);
+		smry.last = smry.start;
+		atexit(smry_fin);
 	}
 
+	for (i = optind; i < argc; i++)
+		err = mvdown_arg(argv[i]);
+	if (user_flags & STDIN)
+		err = mvdown_stdin(window);
+	if (!err && smry.failed)
+		err = -1;
+
 out:
 	return err;
 }
@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+unsigned long long bench_nalloc;
+
+/* the parameters are given by the environment variables */
+unsigned long long bench_param(char *name, unsigned long long def)
+{
+	char *p;
+
+	p = getenv(name);
+	if (p && *p)
+		def = strtoull(p, NULL, 0);
+	return def;
+}
+
+void bench_init(struct bench *b, char *fmt, ...)
+{
+	va_list ap;
+
+	memset(b, 0, sizeof(*b));
+	va_start(ap, fmt);
+	vsnprintf(b->name, sizeof(b->name), fmt, ap);
+	va_end(ap);
+}
+
+void bench_report(struct bench *b)
+{
+	if (!b->nop)
+		b->nop = 1;
+	printf("%-40s %12llu ops %12.1f ns/op %10.3f allocs/op\n",
+	       b->name, b->nop, (double)b->ns / b->nop,
+	       (double)b->nalloc / b->nop);
+	fflush(stdout);
+}
+
+/* ---------------------------------------------------------------------- */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **memptr, size_t alignment, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size)
+{
+	__atomic_add_fetch(&bench_nalloc, 1, __ATOMIC_RELAXED);
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&bench_nalloc, 1, __ATOMIC_RELAXED);
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&bench_nalloc, 1, __ATOMIC_RELAXED);
+	return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	__atomic_add_fetch(&bench_nalloc, 1, __ATOMIC_RELAXED);
+	return __real_posix_memalign(memptr, alignment, size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+	__atomic_add_fetch(&bench_nalloc, 1, __ATOMIC_RELAXED);
+	return __real_strdup(s);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * microbenchmarks for the hot paths.
+ * each bench_*.c includes the source file under test to reach its static
+ * functions, and feeds the synthetic input generated from a fixed seed.
+ * the allocations are counted by "ld --wrap", so only the calls from the
+ * objects in the benchmark are counted, not those inside libc.
+ */
+
+#ifndef __bench_h__
+#define __bench_h__
+
+#include <time.h>
+
+struct bench {
+	char name[64];
+	unsigned long long nop, ns, nalloc;
+
+	/* while running */
+	unsigned long long t, a;
+};
+
+extern unsigned long long bench_nalloc;
+
+unsigned long long bench_param(char *name, unsigned long long def);
+void bench_init(struct bench *b, char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void bench_report(struct bench *b);
+
+static inline unsigned long long bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void bench_start(struct bench *b)
+{
+	b->a = __atomic_load_n(&bench_nalloc, __ATOMIC_RELAXED);
+	b->t = bench_ns();
+}
+
+static inline void bench_stop(struct bench *b, unsigned long long nop)
+{
+	b->ns += bench_ns() - b->t;
+	b->nalloc += __atomic_load_n(&bench_nalloc, __ATOMIC_RELAXED) - b->a;
+	b->nop += nop;
+}
+
+#endif /* __bench_h__ */
@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/*
+ * au_fname_one() over an aufhsm list, move_failed() for a large failed list,
+ * and au_fhsm_csum().
+ * BENCH_FNAME	number of the files in the list
+ * BENCH_WMARK	number of the watermarks, one for each fhsm branch
+ * BENCH_LOOP	number of the repetition
+ */
+
+#include <sys/mman.h>
+#include <sys/sysmacros.h>	/* major() in shm.c */
+#include "../fhsm/list.c"
+#include "../fhsm/fhsm.c"
+#include "../fhsm/log.c"
+#include "../fhsm/shm.c"
+#include "bench.h"
+
+/* the format is "atime size name", see aufhsm-list */
+static unsigned long long mk_list(char *buf, unsigned long long n)
+{
+	unsigned long long ul, sz;
+
+	sz = 0;
+	buf[sz++] = '\0';
+	for (ul = 0; ul < n; ul++)
+		sz += sprintf(buf + sz, "%lu %lu dir%lu/file%llu",
+			      1400000000 + random() % 100000000,
+			      random() % (1 << 24), random() % 100, ul) + 1;
+	return sz;
+}
+
+static void bench_fname(char *list, unsigned long long sz,
+			unsigned long long n, unsigned long long loop)
+{
+	unsigned long long ul, len, sum;
+	struct au_fname fname;
+	struct bench b;
+
+	sum = 0;
+	bench_init(&b, "au_fname_one n=%llu", n);
+	for (ul = 0; ul < loop; ul++) {
+		bench_start(&b);
+		for (len = sz; len > 1; len -= fname.len) {
+			au_fname_one(list, len, &fname);
+			sum += fname.name - fname.atime;
+		}
+		bench_stop(&b, n);
+	}
+	bench_report(&b);
+	if (!sum)
+		exit(1);
+}
+
+static void bench_failed(char *list, unsigned long long sz,
+			 unsigned long long n, unsigned long long loop)
+{
+	int err, listfd, failfd;
+	unsigned long long ul;
+	struct bench b;
+
+	listfd = memfd_create("list", MFD_CLOEXEC);
+	failfd = memfd_create("failed", MFD_CLOEXEC);
+	if (listfd < 0 || failfd < 0)
+		exit(1);
+
+	bench_init(&b, "move_failed n=%llu", n);
+	for (ul = 0; ul < loop; ul++) {
+		/* the failed list has no leading NUL */
+		if (ftruncate(listfd, 0)
+		    || lseek(listfd, 0, SEEK_SET)
+		    || pwrite(failfd, list + 1, sz - 1, 0) != sz - 1)
+			exit(1);
+		bench_start(&b);
+		err = move_failed(listfd, failfd);
+		bench_stop(&b, 1);
+		if (err)
+			exit(1);
+	}
+	bench_report(&b);
+	close(listfd);
+	close(failfd);
+}
+
+static void bench_csum(unsigned long long nwmark, unsigned long long loop)
+{
+	unsigned long long ul, n, sum;
+	struct aufhsm *fhsm;
+	struct bench b;
+
+	fhsm = calloc(1, au_fhsm_size(nwmark));
+	if (!fhsm)
+		exit(1);
+	fhsm->nwmark = nwmark;
+	for (ul = 0; ul < nwmark; ul++) {
+		fhsm->wmark[ul].brid = ul;
+		fhsm->wmark[ul].block[AuFhsm_WM_UPPER] = 0.1;
+		fhsm->wmark[ul].block[AuFhsm_WM_LOWER] = 0.2;
+		fhsm->wmark[ul].inode[AuFhsm_WM_UPPER] = 0.1;
+		fhsm->wmark[ul].inode[AuFhsm_WM_LOWER] = 0.2;
+	}
+
+	sum = 0;
+	n = loop * 1000;
+	bench_init(&b, "au_fhsm_csum nwmark=%llu", nwmark);
+	bench_start(&b);
+	for (ul = 0; ul < n; ul++) {
+		/* defeat hoisting */
+		fhsm->wmark[0].brid = ul;
+		sum += au_fhsm_csum(fhsm);
+	}
+	bench_stop(&b, n);
+	bench_report(&b);
+	free(fhsm);
+	if (!sum)
+		exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long n, nwmark, loop, sz;
+	char *list;
+
+	n = bench_param("BENCH_FNAME", 100000);
+	nwmark = bench_param("BENCH_WMARK", 8);
+	loop = bench_param("BENCH_LOOP", 20);
+
+	srandom(1);
+	list = malloc(n * 64 + 1);
+	if (!list)
+		return 1;
+	sz = mk_list(list, n);
+
+	bench_fname(list, sz, n, loop);
+	bench_failed(list, sz, n, loop);
+	bench_csum(nwmark, loop);
+	free(list);
+
+	return 0;
+}
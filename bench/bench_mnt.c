@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/*
+ * au_proc_getmntent() against a large mount table.
+ * BENCH_MNT	number of the mount entries
+ * BENCH_LOOP	number of the repetition
+ */
+
+#include <mntent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* read the synthetic table instead of /proc/self/mounts */
+static char mounts[] = "/tmp/aubench.mounts.XXXXXX";
+#define setmntent(file, mode)	setmntent(mounts, mode)
+
+#include "../proc_mnt.c"
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+	int err, fd;
+	unsigned long long n, loop, ul;
+	char mntpnt[64];
+	FILE *fp;
+	struct mntent ent;
+	struct bench b;
+
+	n = bench_param("BENCH_MNT", 10000);
+	loop = bench_param("BENCH_LOOP", 20);
+
+	fd = mkstemp(mounts);
+	if (fd < 0)
+		return 1;
+	err = 1;
+	fp = fdopen(fd, "w");
+	if (!fp)
+		goto out;
+	for (ul = 0; ul < n; ul++)
+		if (ul % 10)
+			fprintf(fp, "/dev/sd%llu /mnt/ext4/%llu ext4"
+				" rw,relatime,errors=remount-ro 0 0\n", ul, ul);
+		else
+			fprintf(fp, "none /mnt/aufs/%llu aufs"
+				" rw,relatime,si=%llx,xino=/tmp/.aufs.xino"
+				" 0 0\n", ul, ul);
+	if (fclose(fp))
+		goto out;
+
+	/* the whole table is read anyway */
+	snprintf(mntpnt, sizeof(mntpnt), "/mnt/aufs/%llu", n / 2 / 10 * 10);
+	memset(&ent, 0, sizeof(ent));
+	bench_init(&b, "au_proc_getmntent n=%llu", n);
+	for (ul = 0; ul < loop; ul++) {
+		bench_start(&b);
+		au_proc_getmntent(mntpnt, &ent);
+		bench_stop(&b, 1);
+	}
+	bench_report(&b);
+	err = 0;
+
+out:
+	unlink(mounts);
+	return err;
+}
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * readdir(3) of libau by the threads, each of which reads its own dir.
+ * the dirs are on ausim (sim/), created in a temporary dir and removed at
+ * the end. since ausim reads AUSIM_BR in its constructor, the program
+ * executes itself again with it and BENCH_MT_ROOT.
+ * the time is the wall clock of all threads divided by the total entries,
+ * so it halves as the threads double when it scales linearly. it does only
+ * when the threads run on the distinct CPUs. on a single CPU the threads
+ * are serialized, and a flat time tells only that they don't slow down
+ * each other, not that they scale.
+ * "readdir" seeks to the second entry and reads the merged entries again,
+ * which is the fast path only. "opendir" repeats opendir/readdir/closedir,
+ * which includes the ioctls emulated by ausim, and "opendir+pipe" does it
+ * in the pipelined mode (LIBAU_RDU_PIPE).
+ * BENCH_N	number of the entries in a dir
+ * BENCH_LOOP	number of the repetition in a thread
+ * BENCH_MT	maximum number of the threads, the default is the number of
+ *		the online CPUs
+ */
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <ftw.h>
+
+#include "../libau/rdu_lib.c"
+#include "../libau/rdu.c"
+#include "bench.h"
+
+struct mt {
+	pthread_t th;
+	pthread_barrier_t *barrier;
+	char path[PATH_MAX];
+	int do_open;
+	unsigned long long loop, nent;
+};
+
+static unsigned long long mt_read(DIR *dp)
+{
+	unsigned long long n;
+
+	n = 0;
+	while (readdir(dp))
+		n++;
+	return n;
+}
+
+static void *mt_thread(void *arg)
+{
+	struct mt *mt = arg;
+	unsigned long long ul;
+	DIR *dp;
+
+	mt->nent = 0;
+	dp = NULL;
+	if (!mt->do_open) {
+		dp = opendir(mt->path);
+		if (!dp)
+			goto out;
+		mt_read(dp);
+	}
+
+	pthread_barrier_wait(mt->barrier);
+	for (ul = 0; ul < mt->loop; ul++) {
+		if (mt->do_open) {
+			dp = opendir(mt->path);
+			if (!dp)
+				break;
+			mt->nent += mt_read(dp);
+			closedir(dp);
+		} else {
+			seekdir(dp, 1);
+			mt->nent += mt_read(dp);
+		}
+	}
+	if (!mt->do_open)
+		closedir(dp);
+
+out:
+	return NULL;
+}
+
+static int mt_run(struct mt *mt, int nth, int do_open, unsigned long long loop)
+{
+	int err, i;
+	struct bench b;
+	pthread_barrier_t barrier;
+
+	err = pthread_barrier_init(&barrier, NULL, nth + 1);
+	if (err)
+		goto out;
+	for (i = 0; i < nth; i++) {
+		mt[i].barrier = &barrier;
+		mt[i].do_open = do_open;
+		mt[i].loop = loop;
+		err = pthread_create(&mt[i].th, NULL, mt_thread, mt + i);
+		if (err) {
+			/* the barrier never completes */
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+
+	bench_init(&b, "%s%s threads=%d", do_open ? "opendir" : "readdir",
+		   getenv("LIBAU_RDU_PIPE") ? "+pipe" : "", nth);
+	pthread_barrier_wait(&barrier);
+	bench_start(&b);
+	for (i = 0; i < nth; i++)
+		pthread_join(mt[i].th, NULL);
+	bench_stop(&b, 0);
+	for (i = 0; i < nth; i++) {
+		if (!mt[i].nent)
+			err = -1;
+		b.nop += mt[i].nent;
+	}
+	bench_report(&b);
+	pthread_barrier_destroy(&barrier);
+
+out:
+	return err;
+}
+
+static int mt_rm(const char *path, const struct stat *st, int flag,
+		 struct FTW *ftw)
+{
+	return remove(path);
+}
+
+/* create the dirs, and execute itself with AUSIM_BR */
+static int mt_setup(char *argv[], int nth, unsigned long long n)
+{
+	int err, i, fd;
+	unsigned long long ul;
+	char root[] = "/tmp/bench_mt.XXXXXX", path[PATH_MAX];
+
+	err = -1;
+	if (!mkdtemp(root))
+		goto out;
+	for (i = 0; i < nth; i++) {
+		snprintf(path, sizeof(path), "%s/d%d", root, i);
+		if (mkdir(path, 0700))
+			goto out_rm;
+		for (ul = 0; ul < n; ul++) {
+			snprintf(path, sizeof(path), "%s/d%d/f%llu", root, i,
+				 ul);
+			fd = creat(path, 0600);
+			if (fd < 0)
+				goto out_rm;
+			close(fd);
+		}
+	}
+
+	setenv("AUSIM_BR", root, 1);
+	setenv("BENCH_MT_ROOT", root, 1);
+	setenv("LIBAU", "all", 1);
+	execv("/proc/self/exe", argv);
+	strcpy(path, "/proc/self/exe");
+
+out_rm:
+	perror(path);
+	nftw(root, mt_rm, 16, FTW_DEPTH | FTW_PHYS);
+out:
+	return err;
+}
+
+int main(int argc, char *argv[])
+{
+	int err, nth, maxth, i;
+	unsigned long long n, loop;
+	char *root;
+	struct mt *mt;
+
+	n = bench_param("BENCH_N", 10000);
+	loop = bench_param("BENCH_LOOP", 20);
+	maxth = bench_param("BENCH_MT", sysconf(_SC_NPROCESSORS_ONLN));
+	if (maxth < 2)
+		maxth = 2;
+
+	root = getenv("BENCH_MT_ROOT");
+	if (!root)
+		return mt_setup(argv, maxth, n) ? 1 : 0;
+
+	err = 1;
+	mt = calloc(maxth, sizeof(*mt));
+	if (!mt)
+		goto out;
+	for (i = 0; i < maxth; i++)
+		snprintf(mt[i].path, sizeof(mt[i].path), "%s/d%d", root, i);
+
+	for (nth = 1; nth <= maxth; nth <<= 1)
+		if (mt_run(mt, nth, /*do_open*/0, loop))
+			goto out;
+	for (nth = 1; nth <= maxth; nth <<= 1)
+		if (mt_run(mt, nth, /*do_open*/1, loop))
+			goto out;
+	setenv("LIBAU_RDU_PIPE", "1", 1);
+	for (nth = 1; nth <= maxth; nth <<= 1)
+		if (mt_run(mt, nth, /*do_open*/1, loop))
+			goto out;
+	err = 0;
+
+out:
+	nftw(root, mt_rm, 16, FTW_DEPTH | FTW_PHYS);
+	return err;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/*
+ * ia_test() against the inode numbers of the pseudo-links.
+ * BENCH_PLINK	number of the pseudo-links
+ * BENCH_LOOKUP	number of the lookups, the half of them hit
+ */
+
+#include "../plink.c"
+#include "bench.h"
+
+int main(int argc, char *argv[])
+{
+	unsigned long long m, n, ul, hit;
+	ino_t *p, *q;
+	struct bench b;
+
+	m = bench_param("BENCH_PLINK", 10000);
+	n = bench_param("BENCH_LOOKUP", 100000);
+
+	srandom(1);
+	ia.o = malloc(m * sizeof(ino_t));
+	if (!ia.o)
+		return 1;
+	p = (void *)ia.o;
+	for (ul = 0; ul < m; ul++)
+		p[ul] = 2 * (random() % (m * 16)) + 1;
+	ia.bytes = m * sizeof(ino_t);
+	ia.nino = m;
+
+	/* the odd numbers may hit, and the even ones never */
+	q = malloc(n * sizeof(*q));
+	if (!q)
+		return 1;
+	for (ul = 0; ul < n; ul++)
+		q[ul] = ul % 2 ? p[random() % m] : 2 * random();
+
+	hit = 0;
+	bench_init(&b, "ia_test plink=%llu", m);
+	bench_start(&b);
+	for (ul = 0; ul < n; ul++)
+		hit += ia_test(q[ul]);
+	bench_stop(&b, n);
+	bench_report(&b);
+
+	return hit != n / 2;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+/*
+ * rdu_merge() over the entries of two branches, and rdu_pos() to iterate the
+ * merged ones.
+ * BENCH_N	number of the entries, the half in each branch
+ * BENCH_WH	percentage of the whiteouts in the upper branch
+ * BENCH_LOOP	number of the repetition
+ */
+
+#include "../libau/rdu_lib.c"
+#include "../libau/rdu.c"
+#include "bench.h"
+
+/* the upper has "f%d" or ".wh.g%d", and the lower has "g%d" */
+static unsigned long long mk_ent(char *buf, unsigned long long n,
+				 unsigned long long wh)
+{
+	unsigned long long ul, i, sz;
+	int bindex;
+	struct au_rdu_ent *e;
+
+	sz = 0;
+	for (bindex = 0; bindex < 2; bindex++)
+		for (i = 0; i < n / 2; i++) {
+			e = (void *)(buf + sz);
+			if (!bindex && i % 100 < wh)
+				ul = sprintf(e->name, AUFS_WH_PFX "g%llu", i);
+			else
+				ul = sprintf(e->name, "%c%llu",
+					     bindex ? 'g' : 'f', i);
+			e->ino = bindex * n + i + 1;
+			e->bindex = bindex;
+			e->type = DT_REG;
+			e->nlen = ul;
+			e->wh = 0;
+			sz += au_rdu_len(ul);
+		}
+	return sz;
+}
+
+int main(int argc, char *argv[])
+{
+	int err;
+	unsigned long long n, wh, loop, ul, pos, sz, sum;
+	char *src;
+	struct rdu p;
+	struct bench b;
+	struct Rdu_DIRENT *de;
+
+	n = bench_param("BENCH_N", 100000) & ~1ULL;
+	wh = bench_param("BENCH_WH", 10);
+	loop = bench_param("BENCH_LOOP", 20);
+
+	sz = n * au_rdu_len(NAME_MAX);
+	src = malloc(sz);
+	if (!src)
+		return 1;
+	sz = mk_ent(src, n, wh);
+
+	memset(&p, 0, sizeof(p));
+	p.fd = -1;
+	p.sz = sz;
+	p.ent.e = rdu_pool_get(&p.sz);
+	if (!p.ent.e)
+		return 1;
+
+	bench_init(&b, "rdu_merge n=%llu wh=%llu%%", n, wh);
+	for (ul = 0; ul < loop; ul++) {
+		memcpy(p.ent.e, src, sz);
+		p.npos = n;
+		bench_start(&b);
+		err = rdu_merge(&p);
+		bench_stop(&b, 1);
+		if (err)
+			return 1;
+	}
+	bench_report(&b);
+
+	err = rdu_de(&p);
+	if (err)
+		return 1;
+	sum = 0;
+	bench_init(&b, "rdu_pos n=%llu", p.npos);
+	for (ul = 0; ul < loop; ul++) {
+		bench_start(&b);
+		for (pos = 0; de = NULL, !rdu_pos(&de, &p, pos); pos++)
+			sum += de->d_ino;
+		bench_stop(&b, pos);
+	}
+	bench_report(&b);
+
+	return !sum;
+}
@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2009-2015 Junjiro R. Okajima
+ * Copyright (C) 2009-2016 Junjiro R. Okajima
  *
  * This program, aufs is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -17,9 +17,13 @@
  */
 
 #include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "libau.h"
 
@@ -38,7 +42,123 @@ int libau_dl(void **real, char *sym)
 	return !!p;
 }
 
-/* always retrieve the var from environment, since it can be changed anytime */
+/*
+ * the var in environment can be changed anytime, but parsing it in every
+ * hooked call is too heavy. parse it into a bitmask only when environ(7)
+ * itself or the entry for the var is changed.
+ * when the var doesn't exist, the terminating NULL of environ is watched
+ * instead so that setenv(3) can be detected. modifying the string given to
+ * putenv(3) in place is not detected. the result without the var, or
+ * without environ at all, is cached too.
+ * the result is a single static snapshot guarded by a sequence counter. the
+ * writer makes it odd while updating, and the reader retries by parsing
+ * when the counter is odd or changed, so it never sees a half updated one.
+ * when the writers race, the losers don't update it.
+ */
+static char *libau_name[LibAu_Last] = {
+	[LibAu_readdir]		= "readdir",
+	[LibAu_readdir64]	= "readdir64",
+	[LibAu_readdir_r]	= "readdir_r",
+	[LibAu_readdir64_r]	= "readdir64_r",
+	[LibAu_closedir]	= "closedir",
+	[LibAu_getdents64]	= "getdents64",
+	[LibAu_getdirentries]	= "getdirentries",
+	[LibAu_getdirentries64]	= "getdirentries64",
+	[LibAu_scandir]		= "scandir",
+	[LibAu_scandir64]	= "scandir64",
+	[LibAu_pathconf]	= "pathconf",
+	[LibAu_fpathconf]	= "fpathconf"
+};
+
+struct libau_env {
+	unsigned int	seq;
+	char		**environ, **slot, *str;
+	unsigned int	mask;
+};
+
+static struct libau_env libau_env;
+
+static unsigned int libau_parse(char *e)
+{
+	unsigned int mask;
+	int i, l;
+	char *p;
+
+	mask = 0;
+	if (!e)
+		goto out;
+	DPri("e 0x%02x, %s\n", *e, e);
+
+	if (!*e || !strcasecmp(e, "all")) {
+		mask = (1U << LibAu_Last) - 1;
+		goto out;
+	}
+
+	while (*e) {
+		p = strchrnul(e, ':');
+		l = p - e;
+		for (i = 0; i < LibAu_Last; i++)
+			if (!strncmp(e, libau_name[i], l)
+			    && !libau_name[i][l])
+				mask |= 1U << i;
+		e = p;
+		if (*e)
+			e++;
+	}
+
+ out:
+	DPri("mask 0x%x\n", mask);
+	return mask;
+}
+
+unsigned int libau_test_mask(void)
+{
+	unsigned int seq, mask;
+	int l;
+	char **ep, **cenv, **slot, *str;
+	struct libau_env *env = &libau_env;
+
+	ep = environ;
+	seq = __atomic_load_n(&env->seq, __ATOMIC_ACQUIRE);
+	cenv = __atomic_load_n(&env->environ, __ATOMIC_RELAXED);
+	slot = __atomic_load_n(&env->slot, __ATOMIC_RELAXED);
+	str = __atomic_load_n(&env->str, __ATOMIC_RELAXED);
+	mask = __atomic_load_n(&env->mask, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (!(seq & 1)
+	    && __atomic_load_n(&env->seq, __ATOMIC_RELAXED) == seq
+	    && ep == cenv
+	    && (!ep || *slot == str))
+		return mask;
+
+	slot = NULL;
+	str = NULL;
+	mask = 0;
+	if (ep) {
+		l = sizeof(LibAuEnv) - 1;
+		for (slot = ep; *slot; slot++)
+			if (!strncmp(*slot, LibAuEnv, l) && (*slot)[l] == '=')
+				break;
+		str = *slot;
+		if (str)
+			mask = libau_parse(str + l + 1);
+	}
+
+	if (!(seq & 1)
+	    && __atomic_compare_exchange_n(&env->seq, &seq, seq + 1,
+					   /*weak*/0, __ATOMIC_RELAXED,
+					   __ATOMIC_RELAXED)) {
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		__atomic_store_n(&env->environ, ep, __ATOMIC_RELAXED);
+		__atomic_store_n(&env->slot, slot, __ATOMIC_RELAXED);
+		__atomic_store_n(&env->str, str, __ATOMIC_RELAXED);
+		__atomic_store_n(&env->mask, mask, __ATOMIC_RELAXED);
+		__atomic_store_n(&env->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+	return mask;
+}
+
+/* for the compatibility, libau itself doesn't use it */
 int libau_test_func(char *sym)
 {
 	int ret, l;
@@ -65,3 +185,83 @@ int libau_test_func(char *sym)
 	DPri("%s %d\n", sym, ret);
 	return ret;
 }
+
+/* ---------------------------------------------------------------------- */
+
+struct libau_stat libau_stat;
+int libau_stat_on;
+static char *libau_stat_path;
+
+unsigned long long libau_stat_ns(void)
+{
+	struct timespec ts;
+
+	if (!libau_stat_on || clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void __attribute__((constructor)) libau_stat_init(void)
+{
+	libau_stat_path = getenv("LIBAU_STAT");
+	if (libau_stat_path && *libau_stat_path) {
+		/* the env may be changed later */
+		libau_stat_path = strdup(libau_stat_path);
+		libau_stat_on = !!libau_stat_path;
+	}
+}
+
+#define LibAuStatPr(fmt, ...) do { \
+	if (l < sizeof(a)) \
+		l += snprintf(a + l, sizeof(a) - l, fmt, ##__VA_ARGS__); \
+} while (0)
+
+/* append a line in JSON */
+static void __attribute__((destructor)) libau_stat_dump(void)
+{
+	int fd, i, e;
+	size_t l;
+	char a[2048];
+	unsigned char *u;
+	struct libau_stat *st = &libau_stat;
+
+	if (!libau_stat_on)
+		return;
+
+	l = 0;
+	LibAuStatPr("{\"pid\":%d,\"prog\":\"", getpid());
+	/* the name is given by the user, escape it */
+	for (u = (void *)program_invocation_short_name; *u; u++)
+		if (*u == '"' || *u == '\\')
+			LibAuStatPr("\\%c", *u);
+		else if (*u < 0x20 || *u == 0x7f)
+			LibAuStatPr("\\u%04x", *u);
+		else
+			LibAuStatPr("%c", *u);
+	LibAuStatPr("\",\"call\":{");
+	for (i = 0; i < LibAu_Last; i++)
+		LibAuStatPr("%s\"%s\":[%llu,%llu]", i ? "," : "",
+			    libau_name[i], st->call[i], st->aufs[i]);
+	LibAuStatPr("},\"rdu_init\":%llu,\"rdu_ioctl\":%llu"
+		    ",\"rdu_ino_ioctl\":%llu,\"rdu_cache_hit\":%llu"
+		    ",\"rdu_bytes\":%llu,\"rdu_ent\":%llu,\"rdu_wh\":%llu"
+		    ",\"rdu_drop\":%llu,\"rdu_merge_ns\":%llu"
+		    ",\"rdu_spill\":%llu,\"rdu_reuse\":%llu"
+		    ",\"linkmax_hit\":%llu}\n",
+		    st->rdu_init, st->rdu_ioctl, st->rdu_ino_ioctl,
+		    st->rdu_cache_hit, st->rdu_bytes, st->rdu_ent, st->rdu_wh,
+		    st->rdu_drop, st->rdu_merge_ns, st->rdu_spill,
+		    st->rdu_reuse, st->linkmax_hit);
+	if (l >= sizeof(a))
+		l = sizeof(a) - 1;
+
+	e = errno;
+	fd = open(libau_stat_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+		  0644);
+	if (fd >= 0) {
+		/* ignore the error */
+		l = write(fd, a, l);
+		close(fd);
+	}
+	errno = e;
+}
@@ -29,18 +29,73 @@
 
 int libau_dl(void **real, char *sym);
 int libau_test_func(char *sym);
+unsigned int libau_test_mask(void);
 
 #define LibAuEnv	"LIBAU"
 
+/* the hooks which can be enabled by LibAuEnv, "name1:name2:..." */
+enum {
+	LibAu_readdir,
+	LibAu_readdir64,
+	LibAu_readdir_r,
+	LibAu_readdir64_r,
+	LibAu_closedir,
+	LibAu_getdents64,
+	LibAu_getdirentries,
+	LibAu_getdirentries64,
+	LibAu_scandir,
+	LibAu_scandir64,
+	LibAu_pathconf,
+	LibAu_fpathconf,
+	LibAu_Last
+};
+
 #define LibAuDlFunc(sym) \
 static inline int libau_dl_##sym(void) \
 { \
 	return libau_dl((void *)&real_##sym, #sym); \
 }
+#define LibAuDlFunc2(sym)	LibAuDlFunc(sym)
+
+#define LibAuBit(sym)		(1U << LibAu_##sym)
+#define LibAuBit2(sym)		LibAuBit(sym)
+#define LibAuTestMask(mask)	(libau_test_mask() & (mask))
+#define LibAuTestFunc(sym)	LibAuTestMask(LibAuBit2(sym))
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * the statistics, enabled by the environment variable LIBAU_STAT which is
+ * the path to append the result at exit. the profilers can read the
+ * symbol libau_stat too.
+ */
+struct libau_stat {
+	/* intercepted calls, and the ones on aufs */
+	unsigned long long	call[LibAu_Last], aufs[LibAu_Last];
+
+	/* rdu_init() and the streaming mode */
+	unsigned long long	rdu_init, rdu_ioctl, rdu_ino_ioctl,
+				rdu_cache_hit, rdu_bytes, rdu_ent, rdu_wh,
+				rdu_drop, rdu_merge_ns, rdu_spill,
+				rdu_reuse;
+
+	/* pathconf(_PC_LINK_MAX) */
+	unsigned long long	linkmax_hit;
+};
+
+extern struct libau_stat libau_stat;
+extern int libau_stat_on;
+unsigned long long libau_stat_ns(void);
 
-#define LibAuStr(sym)		#sym
-#define LibAuStr2(sym)		LibAuStr(sym)
-#define LibAuTestFunc(sym)	libau_test_func(LibAuStr2(sym))
+#define LibAuStatAdd(member, n) do { \
+	if (libau_stat_on) \
+		__atomic_add_fetch(&libau_stat.member, (n), \
+				   __ATOMIC_RELAXED); \
+} while (0)
+#define LibAuStatCall(sym)	LibAuStatAdd(call[LibAu_##sym], 1)
+#define LibAuStatCall2(sym)	LibAuStatCall(sym)
+#define LibAuStatAufs(sym)	LibAuStatAdd(aufs[LibAu_##sym], 1)
+#define LibAuStatAufs2(sym)	LibAuStatAufs(sym)
 
 /* ---------------------------------------------------------------------- */
 
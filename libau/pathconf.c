@@ -23,11 +23,16 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <linux/aufs_type.h>
 
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif
+
 #include "libau.h"
 
 static long (*real_pathconf)(const char *path, int name);
@@ -53,11 +58,212 @@ static long do_fpathconf(int fd, int name)
 	return err;
 }
 
+/* ---------------------------------------------------------------------- */
+
+/*
+ * _PC_LINK_MAX of aufs is the one of the writable branch, which may differ
+ * file by file. but when aufs has only one writable branch, the result is
+ * common to all the files in it, and it is cached for the st_dev of aufs
+ * and the id of the branch. the filesystems other than aufs are cached too,
+ * to skip statfs(2).
+ * aufs changes its branches by remount, so the cache is dropped when the
+ * mount table changes, which is known by poll(2) on /proc/self/mounts.
+ * the fd is not shared with the child process, since the event is shared
+ * with the parent. it is dropped by the handler of pthread_atfork(3), or by
+ * comparing the pid when libau is not reentrant.
+ */
+#define LINKMAX_NENT	16
+
+struct linkmax_ent {
+	dev_t		dev;
+	int		aufs;
+	int16_t		brid;
+	long		val;
+};
+
+static struct {
+	int			fd, nent, next;
+#ifndef _REENTRANT
+	pid_t			pid;
+#endif
+	struct linkmax_ent	ent[LINKMAX_NENT];
+} linkmax = {
+	.fd	= -1
+};
+
+/* drop the cache inherited from the parent, must be locked */
+static void linkmax_drop(void)
+{
+	if (linkmax.fd >= 0)
+		close(linkmax.fd);
+	linkmax.fd = -1;
+	linkmax.nent = 0;
+}
+
+#ifdef _REENTRANT
+static pthread_mutex_t linkmax_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+static void linkmax_lock(void)
+{
+	pthread_mutex_lock(&linkmax_mtx);
+}
+
+static void linkmax_unlock(void)
+{
+	pthread_mutex_unlock(&linkmax_mtx);
+}
+
+static void linkmax_child(void)
+{
+	linkmax_drop();
+	linkmax_unlock();
+}
+
+static void __attribute__((constructor)) linkmax_init(void)
+{
+	pthread_atfork(linkmax_lock, linkmax_unlock, linkmax_child);
+}
+
+#define linkmax_forked()	0
+#define linkmax_set_pid()	do {} while (0)
+#else
+#define linkmax_lock()		do {} while (0)
+#define linkmax_unlock()	do {} while (0)
+#define linkmax_forked()	(linkmax.pid != getpid())
+#define linkmax_set_pid()	(linkmax.pid = getpid())
+#endif
+
+/* must be locked */
+static void linkmax_validate(void)
+{
+	struct pollfd pfd;
+
+	if (linkmax.fd >= 0 && linkmax_forked())
+		linkmax_drop();
+	if (linkmax.fd >= 0) {
+		pfd.fd = linkmax.fd;
+		pfd.events = POLLIN | POLLPRI | POLLOUT;
+		if (poll(&pfd, 1, 0) == 1 && pfd.revents == POLLIN)
+			return;
+		/*
+		 * POLLPRI means the mount table is changed. otherwise, the fd
+		 * is closed by someone else, and it is not ours anymore.
+		 * when the number is reused, the file or the device reports
+		 * POLLOUT too.
+		 */
+		if (!(pfd.revents & POLLPRI))
+			linkmax.fd = -1;
+	}
+
+	linkmax.nent = 0;
+	if (linkmax.fd < 0) {
+		linkmax.fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+		linkmax_set_pid();
+	}
+}
+
+/* returns 1 for the cached aufs, 0 for the cached others, or -1 */
+static int linkmax_get(dev_t dev, long *val)
+{
+	int ret, i;
+	struct linkmax_ent *ent;
+
+	ret = -1;
+	linkmax_lock();
+	linkmax_validate();
+	for (i = 0; i < linkmax.nent; i++) {
+		ent = linkmax.ent + i;
+		if (ent->dev == dev) {
+			DPri("dev 0x%llx, brid %d, %ld\n",
+			     (unsigned long long)dev, ent->brid, ent->val);
+			ret = ent->aufs;
+			*val = ent->val;
+			break;
+		}
+	}
+	linkmax_unlock();
+
+	return ret;
+}
+
+static void linkmax_set(dev_t dev, int aufs, int16_t brid, long val)
+{
+	struct linkmax_ent *ent;
+
+	linkmax_lock();
+	if (linkmax.fd >= 0) {
+		ent = linkmax.ent + linkmax.next;
+		ent->dev = dev;
+		ent->aufs = aufs;
+		ent->brid = brid;
+		ent->val = val;
+		linkmax.next = (linkmax.next + 1) % LINKMAX_NENT;
+		if (linkmax.nent < LINKMAX_NENT)
+			linkmax.nent++;
+	}
+	linkmax_unlock();
+}
+
+/* cache val for aufs if it has only one writable branch */
+static void linkmax_set_aufs(int fd, dev_t dev, long val)
+{
+	int nbr, i, e, n;
+	int16_t brid;
+	union aufs_brinfo *brinfo;
+
+	e = errno;
+	nbr = ioctl(fd, AUFS_CTL_BRINFO, NULL);
+	if (nbr <= 0)
+		goto out;
+	brinfo = malloc(nbr * sizeof(*brinfo));
+	if (!brinfo)
+		goto out;
+	if (ioctl(fd, AUFS_CTL_BRINFO, brinfo))
+		goto out_free;
+
+	n = 0;
+	brid = -1;
+	for (i = 0; i < nbr; i++)
+		if (brinfo[i].perm & AuBrPerm_RW) {
+			brid = brinfo[i].id;
+			n++;
+		}
+	if (n == 1)
+		linkmax_set(dev, /*aufs*/1, brid, val);
+
+ out_free:
+	free(brinfo);
+ out:
+	errno = e;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* open the dir which contains path, O_PATH is enough for the file */
+static int open_parent(const char *path)
+{
+	int l;
+	char *p;
+
+	l = strlen(path);
+	while (l > 1 && path[l - 1] == '/')
+		l--;
+	while (l > 0 && path[l - 1] != '/')
+		l--;
+	if (!l)
+		return open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	while (l > 1 && path[l - 1] == '/')
+		l--;
+	p = strndupa(path, l);
+	return open(p, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
 static int open_aufs_fd(const char *path, DIR **rdp)
 {
-	int err, l, e;
-	struct stat base, st;
-	char *parent, *p;
+	int err, fd, pfd, e;
+	dev_t dev;
+	ino_t ino;
+	struct stat st;
 
 	*rdp = NULL;
 	err = open(path, O_RDONLY);
@@ -86,44 +292,45 @@ static int open_aufs_fd(const char *path, DIR **rdp)
 	 * when open(2) for the specified path failed,
 	 * then try opening its ancestor instead in order to get a file
 	 * descriptor in aufs.
+	 * the ancestors are followed by O_PATH and "..", relative to the
+	 * previous one. note that ioctl(2) is not allowed for O_PATH, and
+	 * the ancestor has to be opened for read.
 	 */
-	err = stat(path, &base);
+	err = stat(path, &st);
 	if (err)
 		goto out;
-	parent = malloc(strlen(path) + sizeof("/.."));
-	if (!parent)
-		goto out;
-	l = strlen(path);
-	while (path[l - 1] == '/')
-		l--;
-	memcpy(parent, path, l);
-	parent[l - 1] = 0;
-	while (1) {
-		strcat(parent, "/..");
-		err = stat(parent, &st);
-		if (err)
+	dev = st.st_dev;
+	ino = st.st_ino;
+	err = -1;
+	fd = open_parent(path);
+	while (fd >= 0) {
+		if (fstat(fd, &st))
 			break;
-		err = -1;
 		errno = ENOTSUP;
-		if (st.st_dev != base.st_dev) {
+		if (st.st_dev != dev) {
 			error_at_line(0, errno, __FILE__, __LINE__,
 				      "cannot handle %s\n", path);
 			break;
 		}
-		*rdp = opendir(parent);
-		if (*rdp) {
-			err = dirfd(*rdp);
+		errno = EACCES;
+		if (st.st_ino == ino)
+			break; /* reached the root */
+		ino = st.st_ino;
+
+		err = openat(fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (err >= 0)
 			break; /* success */
-		}
-		p = realloc(parent, strlen(parent) + sizeof("/.."));
-		if (p)
-			parent = p;
-		else
+		if (errno != EACCES && errno != EPERM)
 			break;
+		pfd = openat(fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+		close(fd);
+		fd = pfd;
+	}
+	if (fd >= 0) {
+		e = errno;
+		close(fd);
+		errno = e;
 	}
-	e = errno;
-	free(parent);
-	errno = e;
 
  out:
 	return err;
@@ -131,20 +338,38 @@ static int open_aufs_fd(const char *path, DIR **rdp)
 
 static long libau_pathconf(const char *path, int name)
 {
-	long err;
+	long err, val;
+	struct stat st;
 	struct statfs stfs;
-	int fd, e;
+	int fd, e, aufs;
 	DIR *dp;
 
-	err = statfs(path, &stfs);
+	err = stat(path, &st);
 	if (err)
 		goto out;
+	aufs = linkmax_get(st.st_dev, &val);
+	if (aufs > 0) {
+		LibAuStatAufs(pathconf);
+		LibAuStatAdd(linkmax_hit, 1);
+		err = val;
+		goto out;
+	} else if (aufs < 0) {
+		err = statfs(path, &stfs);
+		if (err)
+			goto out;
+		aufs = (stfs.f_type == AUFS_SUPER_MAGIC);
+		if (!aufs)
+			linkmax_set(st.st_dev, /*aufs*/0, -1, 0);
+	}
 
 	err = -1;
-	if (stfs.f_type == AUFS_SUPER_MAGIC) {
+	if (aufs) {
+		LibAuStatAufs(pathconf);
 		fd = open_aufs_fd(path, &dp);
 		if (fd >= 0) {
 			err = do_fpathconf(fd, name);
+			if (err >= 0)
+				linkmax_set_aufs(fd, st.st_dev, err);
 			e = errno;
 			if (!dp)
 				close(fd); /* ignore */
@@ -165,8 +390,10 @@ long pathconf(const char *path, int name)
 
 	ret = -1;
 	if (name == _PC_LINK_MAX
-	    && (LibAuTestFunc(pathconf) || LibAuTestFunc(fpathconf)))
+	    && LibAuTestMask(LibAuBit(pathconf) | LibAuBit(fpathconf))) {
+		LibAuStatCall(pathconf);
 		ret = libau_pathconf(path, name);
+	}
 	else if (!libau_dl_pathconf())
 		ret = real_pathconf(path, name);
 
@@ -177,17 +404,36 @@ long pathconf(const char *path, int name)
 
 static long libau_fpathconf(int fd, int name)
 {
-	long err;
+	long err, val;
+	struct stat st;
 	struct statfs stfs;
+	int aufs;
 
-	err = fstatfs(fd, &stfs);
+	err = fstat(fd, &st);
 	if (err)
 		goto out;
+	aufs = linkmax_get(st.st_dev, &val);
+	if (aufs > 0) {
+		LibAuStatAufs(fpathconf);
+		LibAuStatAdd(linkmax_hit, 1);
+		err = val;
+		goto out;
+	} else if (aufs < 0) {
+		err = fstatfs(fd, &stfs);
+		if (err)
+			goto out;
+		aufs = (stfs.f_type == AUFS_SUPER_MAGIC);
+		if (!aufs)
+			linkmax_set(st.st_dev, /*aufs*/0, -1, 0);
+	}
 
 	err = -1;
-	if (stfs.f_type == AUFS_SUPER_MAGIC)
+	if (aufs) {
+		LibAuStatAufs(fpathconf);
 		err = do_fpathconf(fd, name);
-	else if (!libau_dl_fpathconf())
+		if (err >= 0)
+			linkmax_set_aufs(fd, st.st_dev, err);
+	} else if (!libau_dl_fpathconf())
 		err = real_fpathconf(fd, name);
 
  out:
@@ -200,8 +446,10 @@ long fpathconf(int fd, int name)
 
 	ret = -1;
 	if (name == _PC_LINK_MAX
-	    && (LibAuTestFunc(pathconf) || LibAuTestFunc(fpathconf)))
+	    && LibAuTestMask(LibAuBit(pathconf) | LibAuBit(fpathconf))) {
+		LibAuStatCall(fpathconf);
 		ret = libau_fpathconf(fd, name);
+	}
 	else if (!libau_dl_fpathconf())
 		ret = real_fpathconf(fd, name);
 
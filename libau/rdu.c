@@ -16,37 +16,43 @@
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
-#include <sys/vfs.h>    /* or <sys/statfs.h> */
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "rdu.h"
 
-static int rdu_pos(struct Rdu_DIRENT *de, struct rdu *p, long pos)
+static int rdu_pos(struct Rdu_DIRENT **de, struct rdu *p, long pos)
 {
 	int err;
-	struct au_rdu_ent *ent;
-
-	err = -1;
-	if (pos < p->npos) {
-		ent = p->pos[pos];
-		de->d_ino = ent->ino;
-		de->d_off = pos;
-		de->d_reclen = au_rdu_len(ent->nlen);
-		de->d_type = ent->type;
-		strcpy(de->d_name, ent->name);
-		err = 0;
+	struct dirent64 *d;
+
+	err = rdu_more(p, pos);
+	if (!err) {
+		d = rdu_pos_de(p, pos - p->base);
+		if (!*de && RduZeroCopy)
+			*de = (void *)d;
+		else {
+			if (!*de)
+				*de = p->de;
+			(*de)->d_ino = d->d_ino;
+			(*de)->d_off = d->d_off;
+			(*de)->d_reclen = d->d_reclen;
+			(*de)->d_type = d->d_type;
+			strcpy((*de)->d_name, d->d_name);
+		}
 	}
 	return err;
 }
 
 static int rdu_readdir(DIR *dir, struct Rdu_DIRENT *de, struct Rdu_DIRENT **rde)
 {
-	int err, fd;
+	int err, fd, e;
 	struct rdu *p;
 	long pos;
-	struct statfs stfs;
 
 	if (rde)
 		*rde = NULL;
@@ -57,23 +63,24 @@ static int rdu_readdir(DIR *dir, struct Rdu_DIRENT *de, struct Rdu_DIRENT **rde)
 	if (fd < 0)
 		goto out;
 
-	err = fstatfs(fd, &stfs);
-	if (err)
+	err = rdu_fs_aufs(dir, fd);
+	if (err < 0)
 		goto out;
 
 	errno = 0;
-	if (stfs.f_type == AUFS_SUPER_MAGIC) {
-		err = rdu_lib_init();
-		if (err)
-			goto out;
-
+	if (err) {
+		if (!de)
+			LibAuStatAufs2(Rdu_READDIR);
+		else
+			LibAuStatAufs2(Rdu_READDIR_R);
+		err = -1;
 		p = rdu_buf_lock(fd);
 		if (!p)
 			goto out;
 
 		pos = telldir(dir);
-		if (!pos || !p->npos) {
-			err = rdu_init(p, /*want_de*/!de);
+		if (!pos || !p->ent.e) {
+			err = rdu_init(p, /*want_de*/!de && !RduZeroCopy);
 			if (err) {
 				int e = errno;
 				rdu_free(p);
@@ -82,23 +89,25 @@ static int rdu_readdir(DIR *dir, struct Rdu_DIRENT *de, struct Rdu_DIRENT **rde)
 			}
 		}
 
-		if (!de) {
-			de = p->de;
-			if (!de) {
+		if (!de && !RduZeroCopy) {
+			if (!p->de) {
 				rdu_unlock(p);
 				errno = EINVAL;
 				err = -1;
 				goto out;
 			}
 		}
-		err = rdu_pos(de, p, pos);
+		e = 0;
+		err = rdu_pos(&de, p, pos);
 		if (!err)
 			*rde = de;
-		else
+		else if (err > 0)
 			err = 0;
+		else
+			e = errno;
 		seekdir(dir, pos + 1);
 		rdu_unlock(p);
-		errno = 0;
+		errno = e;
 	} else if (!de) {
 		if (!Rdu_DL_READDIR()) {
 			err = 0;
@@ -124,6 +133,7 @@ struct Rdu_DIRENT *Rdu_READDIR(DIR *dir)
 	int err __attribute__((unused));
 
 	if (LibAuTestFunc(Rdu_READDIR)) {
+		LibAuStatCall2(Rdu_READDIR);
 		err = rdu_readdir(dir, NULL, &de);
 		/* DPri("err %d\n", err); */
 	} else if (!Rdu_DL_READDIR())
@@ -137,11 +147,271 @@ struct Rdu_DIRENT *Rdu_READDIR(DIR *dir)
 int (*Rdu_REAL_READDIR_R)(DIR *dir, struct Rdu_DIRENT *de, struct Rdu_DIRENT **rde);
 int Rdu_READDIR_R(DIR *dir, struct Rdu_DIRENT *de, struct Rdu_DIRENT **rde)
 {
-	if (LibAuTestFunc(Rdu_READDIR_R))
+	if (LibAuTestFunc(Rdu_READDIR_R)) {
+		LibAuStatCall2(Rdu_READDIR_R);
 		return rdu_readdir(dir, de, rde);
+	}
 	else if (!Rdu_DL_READDIR_R())
 		return Rdu_REAL_READDIR_R(dir, de, rde);
 	else
 		return errno;
 }
 #endif
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * fill buf with the entries from the file position of fd, as getdents(2).
+ * the position is the index of the entry, same as telldir(3).
+ */
+static ssize_t rdu_getdents(int fd, char *buf, size_t nbytes,
+			    Rdu_OFF_T *basep)
+{
+	ssize_t ret;
+	int err, e;
+	off_t pos;
+	size_t len, nlen;
+	struct rdu *p;
+	struct dirent64 *d;
+	struct Rdu_DIRENT *de;
+
+	ret = -1;
+	p = rdu_buf_lock(fd);
+	if (!p)
+		goto out;
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		goto out_unlock;
+	if (!pos || !p->ent.e) {
+		if (rdu_eof(p, pos)) {
+			if (basep)
+				*basep = pos;
+			ret = 0;
+			goto out_unlock;
+		}
+		err = rdu_init(p, /*want_de*/0);
+		if (err) {
+			e = errno;
+			rdu_free(p);
+			errno = e;
+			goto out;
+		}
+	}
+
+	if (basep)
+		*basep = pos;
+	ret = 0;
+	while (1) {
+		err = rdu_more(p, pos);
+		if (err) {
+			if (err < 0 && !ret)
+				ret = -1;
+			break;
+		}
+		d = rdu_pos_de(p, pos - p->base);
+		nlen = strlen(d->d_name);
+		len = Rdu_RECLEN(nlen);
+		if (ret + len > nbytes) {
+			if (!ret) {
+				errno = EINVAL;
+				ret = -1;
+			}
+			break;
+		}
+		de = (void *)(buf + ret);
+		de->d_ino = d->d_ino;
+		de->d_off = pos + 1;
+		de->d_reclen = len;
+		de->d_type = d->d_type;
+		memcpy(de->d_name, d->d_name, nlen + 1);
+		ret += len;
+		pos++;
+	}
+	e = errno;
+	lseek(fd, pos, SEEK_SET);
+	/*
+	 * nobody tells us when a bare fd is closed, so the entries are
+	 * dropped at the end of the dir. the fd seeked back gets them again,
+	 * and the one staying there gets nothing while the dir is unchanged,
+	 * see rdu_eof().
+	 */
+	if (!ret) {
+		p->eof = p->key.valid ? pos : 0;
+		rdu_free(p);
+		errno = e;
+		goto out;
+	}
+	errno = e;
+
+ out_unlock:
+	rdu_unlock(p);
+ out:
+	return ret;
+}
+
+#ifdef Rdu64
+static ssize_t (*real_getdents64)(int fd, void *buf, size_t nbytes);
+LibAuDlFunc(getdents64);
+
+ssize_t getdents64(int fd, void *buf, size_t nbytes)
+{
+	int err;
+
+	if (LibAuTestFunc(getdents64)) {
+		LibAuStatCall(getdents64);
+		err = rdu_fs_aufs(NULL, fd);
+		if (err > 0) {
+			LibAuStatAufs(getdents64);
+			return rdu_getdents(fd, buf, nbytes, NULL);
+		}
+		else if (err < 0)
+			return -1;
+	}
+	if (!libau_dl_getdents64())
+		return real_getdents64(fd, buf, nbytes);
+	return -1;
+}
+#endif
+
+#ifdef __GNU_LIBRARY__
+static ssize_t (*Rdu_REAL_GETDIRENTRIES)(int fd, char *buf, size_t nbytes,
+					 Rdu_OFF_T *basep);
+LibAuDlFunc2(Rdu_GETDIRENTRIES);
+
+ssize_t Rdu_GETDIRENTRIES(int fd, char *buf, size_t nbytes, Rdu_OFF_T *basep)
+{
+	int err;
+
+	if (LibAuTestFunc(Rdu_GETDIRENTRIES)) {
+		LibAuStatCall2(Rdu_GETDIRENTRIES);
+		err = rdu_fs_aufs(NULL, fd);
+		if (err > 0) {
+			LibAuStatAufs2(Rdu_GETDIRENTRIES);
+			return rdu_getdents(fd, buf, nbytes, basep);
+		}
+		else if (err < 0)
+			return -1;
+	}
+	if (!Rdu_DL_GETDIRENTRIES())
+		return Rdu_REAL_GETDIRENTRIES(fd, buf, nbytes, basep);
+	return -1;
+}
+#endif
+
+/* ---------------------------------------------------------------------- */
+
+typedef int (*rdu_sel_t)(const struct Rdu_DIRENT *);
+typedef int (*rdu_cmp_t)(const struct Rdu_DIRENT **,
+			 const struct Rdu_DIRENT **);
+
+/*
+ * scandir(3) for aufs, which reads the merged entries directly instead of
+ * readdir(3) which glibc calls internally.
+ * returns the number of entries, -1 for an error, or -2 if dir is not aufs.
+ */
+static int rdu_scandir(const char *dir, struct Rdu_DIRENT ***namelist,
+		       rdu_sel_t sel, rdu_cmp_t cmp)
+{
+	int err, fd, e, n, sz;
+	unsigned long long pos;
+	size_t nlen;
+	struct rdu *p;
+	struct dirent64 *d;
+	struct Rdu_DIRENT *de, **list, **t;
+
+	n = -1;
+	fd = open(dir, O_RDONLY | O_NDELAY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	err = rdu_fs_aufs(NULL, fd);
+	if (err <= 0) {
+		if (!err)
+			n = -2;
+		goto out_close;
+	}
+	LibAuStatAufs2(Rdu_SCANDIR);
+	p = rdu_buf_lock(fd);
+	if (!p)
+		goto out_close;
+	err = rdu_init(p, /*want_de*/0);
+	if (err)
+		goto out_free;
+
+	n = 0;
+	sz = 0;
+	list = NULL;
+	for (pos = 0; !(err = rdu_more(p, pos)); pos++) {
+		d = rdu_pos_de(p, pos - p->base);
+		if (RduZeroCopy && sel && !sel((void *)d))
+			continue;
+		nlen = strlen(d->d_name);
+		de = malloc(Rdu_RECLEN(nlen));
+		if (!de)
+			goto out_list;
+		de->d_ino = d->d_ino;
+		de->d_off = d->d_off;
+		de->d_reclen = Rdu_RECLEN(nlen);
+		de->d_type = d->d_type;
+		memcpy(de->d_name, d->d_name, nlen + 1);
+		if (!RduZeroCopy && sel && !sel(de)) {
+			free(de);
+			continue;
+		}
+		if (n == sz) {
+			/* the number of entries is known unless streaming */
+			sz = sz ? sz * 2 : p->npos + 1;
+			t = realloc(list, sz * sizeof(*list));
+			if (!t) {
+				free(de);
+				goto out_list;
+			}
+			list = t;
+		}
+		list[n++] = de;
+	}
+	if (err < 0)
+		goto out_list;
+
+	if (cmp)
+		qsort(list, n, sizeof(*list),
+		      (int (*)(const void *, const void *))cmp);
+	*namelist = list;
+	goto out_free;
+
+ out_list:
+	while (n > 0)
+		free(list[--n]);
+	free(list);
+	n = -1;
+ out_free:
+	e = errno;
+	rdu_free(p);
+	errno = e;
+ out_close:
+	e = errno;
+	close(fd);
+	errno = e;
+ out:
+	return n;
+}
+
+static int (*Rdu_REAL_SCANDIR)(const char *dir,
+			       struct Rdu_DIRENT ***namelist,
+			       rdu_sel_t sel, rdu_cmp_t cmp);
+LibAuDlFunc2(Rdu_SCANDIR);
+
+int Rdu_SCANDIR(const char *dir, struct Rdu_DIRENT ***namelist,
+		rdu_sel_t sel, rdu_cmp_t cmp)
+{
+	int n;
+
+	if (LibAuTestFunc(Rdu_SCANDIR)) {
+		LibAuStatCall2(Rdu_SCANDIR);
+		n = rdu_scandir(dir, namelist, sel, cmp);
+		if (n != -2)
+			return n;
+	}
+	if (!Rdu_DL_SCANDIR())
+		return Rdu_REAL_SCANDIR(dir, namelist, sel, cmp);
+	return -1;
+}
@@ -25,6 +25,9 @@
 
 #include <assert.h>
 #include <dirent.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
 #include <linux/aufs_type.h>
 #include "libau.h"
 
@@ -36,6 +39,13 @@
 #define Rdu_REAL_READDIR_R	real_readdir64_r
 #define Rdu_DL_READDIR		libau_dl_readdir64
 #define Rdu_DL_READDIR_R	libau_dl_readdir64_r
+#define Rdu_GETDIRENTRIES	getdirentries64
+#define Rdu_SCANDIR		scandir64
+#define Rdu_REAL_GETDIRENTRIES	real_getdirentries64
+#define Rdu_REAL_SCANDIR	real_scandir64
+#define Rdu_DL_GETDIRENTRIES	libau_dl_getdirentries64
+#define Rdu_DL_SCANDIR		libau_dl_scandir64
+#define Rdu_OFF_T		off64_t
 #else
 #define Rdu_DIRENT		dirent
 #define Rdu_READDIR		readdir
@@ -44,10 +54,50 @@
 #define Rdu_REAL_READDIR_R	real_readdir_r
 #define Rdu_DL_READDIR		libau_dl_readdir
 #define Rdu_DL_READDIR_R	libau_dl_readdir_r
+#define Rdu_GETDIRENTRIES	getdirentries
+#define Rdu_SCANDIR		scandir
+#define Rdu_REAL_GETDIRENTRIES	real_getdirentries
+#define Rdu_REAL_SCANDIR	real_scandir
+#define Rdu_DL_GETDIRENTRIES	libau_dl_getdirentries
+#define Rdu_DL_SCANDIR		libau_dl_scandir
+#define Rdu_OFF_T		off_t
 #endif
 
+#ifndef __GNU_LIBRARY__
+/* musl libc has the 64bit dirent only */
+#ifndef dirent64
+#define dirent64		dirent
+#endif
+#endif
+
+/*
+ * rdu_init() lays the entries out in struct dirent64, and readdir(3)
+ * returns them directly when struct Rdu_DIRENT has the same layout.
+ */
+#define Rdu_DE_LEN(nlen)	ALIGN(offsetof(struct dirent64, d_name) \
+				      + (nlen) + 1, sizeof(uint64_t))
+/* the length of a record for getdents(2) and scandir(3) */
+#define Rdu_RECLEN(nlen)	ALIGN(offsetof(struct Rdu_DIRENT, d_name) \
+				      + (nlen) + 1, \
+				      __alignof__(struct Rdu_DIRENT))
+#define RduZeroCopy		(sizeof(struct Rdu_DIRENT) \
+				 == sizeof(struct dirent64) \
+				 && offsetof(struct Rdu_DIRENT, d_name) \
+				 == offsetof(struct dirent64, d_name))
+
 /* ---------------------------------------------------------------------- */
 
+/* the attributes of the dir when it was listed, see rdu_reuse() */
+struct rdu_key {
+	int			valid, shwh, noino;
+	uint32_t		gen;
+	unsigned long long	dev, ino, size, nlink;
+	struct timespec		mtime, ctime;
+};
+
+/* not to share a cache line between the DIR streams, see rdu_lib.c */
+#define RDU_CACHELINE		64
+
 struct rdu {
 #ifdef _REENTRANT
 	pthread_rwlock_t lock;
@@ -56,21 +106,72 @@ struct rdu {
 	int fd, shwh;
 	struct Rdu_DIRENT *de;
 
-	unsigned long long npos, idx;
-	struct au_rdu_ent **pos;
+	/*
+	 * p->pos[0] is the entry at base, see rdu_more().
+	 * an element is the offset of struct au_rdu_ent while merging, or
+	 * struct dirent64 after rdu_init(), from p->ent in 8 bytes.
+	 */
+	unsigned long long base, npos, idx, pos_sz;
+	uint32_t *pos;
 
 	unsigned long long nent, sz;
 	union au_rdu_ent_ul ent;
 
 	struct au_rdu_ent *real, *wh;
-};
+
+	/*
+	 * p->ent points into it when the listing is shared, see rdu_cache.c,
+	 * or spilled to spill_fd, see rdu_ent_grow().
+	 */
+	void *map;
+	unsigned long long map_sz;
+	int spill_fd;
+
+	struct rdu_key key;
+	struct rdu_stream *stream;
+
+	/* the position where getdents(2) dropped the entries, see rdu.c */
+	unsigned long long eof;
+} __attribute__((aligned(RDU_CACHELINE)));
+
+/* both of the entries are aligned to 8 bytes, and 32 bits cover 32GB */
+#define RDU_POS_SHIFT		3
+#define RDU_POS_MAX		(1ULL << (32 + RDU_POS_SHIFT))
+
+static inline void *rdu_pos_ptr(struct rdu *p, unsigned long long idx)
+{
+	return (char *)p->ent.e + ((unsigned long long)p->pos[idx]
+				   << RDU_POS_SHIFT);
+}
+
+static inline uint32_t rdu_pos_off(struct rdu *p, void *a)
+{
+	return ((char *)a - (char *)p->ent.e) >> RDU_POS_SHIFT;
+}
+
+#define rdu_pos_ent(p, idx)	((struct au_rdu_ent *)rdu_pos_ptr(p, idx))
+#define rdu_pos_de(p, idx)	((struct dirent64 *)rdu_pos_ptr(p, idx))
 
 /* rdu_lib.c */
-int rdu_lib_init(void);
+void *rdu_pool_get(unsigned long long *sz);
+void rdu_pool_put(void *buf, unsigned long long sz);
+int rdu_pos_alloc(struct rdu *p);
+int rdu_fs_aufs(DIR *dir, int fd);
 struct rdu *rdu_buf_lock(int fd);
+int rdu_more(struct rdu *p, unsigned long long pos);
 int rdu_init(struct rdu *p, int want_de);
+int rdu_eof(struct rdu *p, unsigned long long pos);
 void rdu_free(struct rdu *p);
 
+/* rdu_cache.c */
+struct stat;
+char *rdu_cache_dir(void);
+int rdu_cache_recent(struct stat *st);
+void rdu_cache_unmap(struct rdu *p);
+int rdu_cache_load(struct rdu *p, char *dir, struct stat *st, uint32_t gen,
+		   int shwh);
+void rdu_cache_store(struct rdu *p, char *dir, struct stat *st, uint32_t gen);
+
 /* ---------------------------------------------------------------------- */
 
 extern struct Rdu_DIRENT *(*Rdu_REAL_READDIR)(DIR *dir);
@@ -108,13 +209,11 @@ static inline void rdu_rwlock_init(struct rdu *p)
 
 static inline void rdu_read_lock(struct rdu *p)
 {
-	rdu_lib_must_lock();
 	pthread_rwlock_rdlock(&p->lock);
 }
 
 static inline void rdu_write_lock(struct rdu *p)
 {
-	rdu_lib_must_lock();
 	pthread_rwlock_wrlock(&p->lock);
 }
 
@@ -0,0 +1,355 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * the merged listings shared between the processes.
+ * when the environment variable LIBAU_RDU_CACHE is set to a directory
+ * (preferably on tmpfs, such as /dev/shm/libau), rdu_init() stores the
+ * merged entries of a dir in a file there, and the other processes map it
+ * instead of issuing the ioctls. the file is named after the aufs st_dev
+ * and the inode number of the dir, and it is never modified but replaced
+ * by rename(2). the header holds the key, which is compared with the
+ * current attributes of the dir and the generation of aufs.
+ * only the files owned by the same user are trusted.
+ * the stale file found by rdu_cache_load() is removed, and the total size
+ * of the files is limited by LIBAU_RDU_CACHE_MAX (64MB by default). when
+ * it is exceeded, the least recently used ones are removed, as far as the
+ * timestamps tell.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rdu.h"
+
+#define RDU_CACHE_MAGIC		0x72647531	/* "rdu1" */
+#define RDU_CACHE_MAX		(64ULL << 20)
+/* rdu_cache_evict() runs for every this number of stores in a process */
+#define RDU_CACHE_EVICT_INTVL	16
+
+struct rdu_cache_hdr {
+	uint32_t	magic, generation;
+	uint64_t	dev, ino, size, nlink;
+	int64_t		mtime, mtime_ns, ctime, ctime_ns;
+	uint64_t	npos, sz;
+	uint32_t	shwh, pad;
+} __attribute__((aligned(8)));
+
+char *rdu_cache_dir(void)
+{
+	char *dir;
+
+	dir = getenv("LIBAU_RDU_CACHE");
+	if (dir && *dir != '/')
+		dir = NULL;
+	return dir;
+}
+
+static void rdu_cache_key(struct rdu_cache_hdr *h, struct stat *st,
+			  uint32_t gen, int shwh)
+{
+	memset(h, 0, sizeof(*h));
+	h->magic = RDU_CACHE_MAGIC;
+	h->generation = gen;
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->size = st->st_size;
+	h->nlink = st->st_nlink;
+	h->mtime = st->st_mtim.tv_sec;
+	h->mtime_ns = st->st_mtim.tv_nsec;
+	h->ctime = st->st_ctim.tv_sec;
+	h->ctime_ns = st->st_ctim.tv_nsec;
+	h->shwh = !!shwh;
+}
+
+static int rdu_cache_path(char *path, char *dir, struct stat *st, int tmp)
+{
+	int l;
+
+	l = snprintf(path, PATH_MAX, "%s/%s%llx-%llx%s", dir, tmp ? "." : "",
+		     (unsigned long long)st->st_dev,
+		     (unsigned long long)st->st_ino, tmp ? ".XXXXXX" : "");
+	return (l < 0 || l >= PATH_MAX) ? -1 : 0;
+}
+
+/* remove the stale file, unless it has been replaced already */
+static void rdu_cache_unlink(char *path, struct stat *cst)
+{
+	int e;
+	struct stat st;
+
+	e = errno;
+	if (!lstat(path, &st)
+	    && st.st_dev == cst->st_dev
+	    && st.st_ino == cst->st_ino)
+		unlink(path);
+	errno = e;
+}
+
+static unsigned long long rdu_cache_max(void)
+{
+	unsigned long long ull;
+	char *e;
+
+	ull = RDU_CACHE_MAX;
+	e = getenv("LIBAU_RDU_CACHE_MAX");
+	if (e && *e)
+		ull = strtoull(e, NULL, 0);
+	return ull;
+}
+
+struct rdu_cache_ent {
+	char			name[40];
+	time_t			t;
+	unsigned long long	sz;
+};
+
+static int rdu_cache_cmp(const void *_a, const void *_b)
+{
+	const struct rdu_cache_ent *a = _a, *b = _b;
+
+	return (a->t > b->t) - (a->t < b->t);
+}
+
+/*
+ * remove the least recently used files while the total exceeds the limit,
+ * down to 3/4 of it. getdents64(2) is issued directly, not to go through
+ * our own readdir(3).
+ */
+static void rdu_cache_evict(char *dir)
+{
+	int dfd, n, sz;
+	long l, off;
+	unsigned long long total, max;
+	time_t t;
+	char buf[8192];
+	struct dirent64 *de;
+	struct stat st;
+	struct rdu_cache_ent *ent, *tmp;
+
+	dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dfd < 0)
+		return;
+
+	n = 0;
+	sz = 0;
+	ent = NULL;
+	total = 0;
+	while ((l = syscall(SYS_getdents64, dfd, buf, sizeof(buf))) > 0)
+		for (off = 0; off < l; off += de->d_reclen) {
+			de = (void *)(buf + off);
+			/* the temporary files and . and .. */
+			if (de->d_name[0] == '.'
+			    || strlen(de->d_name) >= sizeof(ent->name)
+			    || fstatat(dfd, de->d_name, &st,
+				       AT_SYMLINK_NOFOLLOW)
+			    || !S_ISREG(st.st_mode)
+			    || st.st_uid != geteuid())
+				continue;
+			if (n == sz) {
+				sz = sz ? sz << 1 : 64;
+				tmp = realloc(ent, sz * sizeof(*ent));
+				if (!tmp)
+					goto out;
+				ent = tmp;
+			}
+			strcpy(ent[n].name, de->d_name);
+			t = st.st_atim.tv_sec;
+			if (t < st.st_mtim.tv_sec)
+				t = st.st_mtim.tv_sec;
+			ent[n].t = t;
+			ent[n].sz = st.st_size;
+			total += st.st_size;
+			n++;
+		}
+
+	max = rdu_cache_max();
+	if (total <= max)
+		goto out;
+	qsort(ent, n, sizeof(*ent), rdu_cache_cmp);
+	max -= max / 4;
+	for (sz = 0; sz < n && total > max; sz++)
+		if (!unlinkat(dfd, ent[sz].name, 0))
+			total -= ent[sz].sz;
+
+ out:
+	free(ent);
+	close(dfd);
+}
+
+void rdu_cache_unmap(struct rdu *p)
+{
+	munmap(p->map, p->map_sz);
+	p->map = NULL;
+	p->map_sz = 0;
+	p->ent.e = NULL;
+}
+
+/* returns 0 when the valid cache is mapped */
+int rdu_cache_load(struct rdu *p, char *dir, struct stat *st, uint32_t gen,
+		   int shwh)
+{
+	int err, fd;
+	unsigned long long ul;
+	char path[PATH_MAX], *a, *start, *end;
+	struct stat cst;
+	struct rdu_cache_hdr key, *h;
+	struct dirent64 *de;
+
+	err = -1;
+	if (rdu_cache_path(path, dir, st, /*tmp*/0))
+		goto out;
+	fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if (fd < 0)
+		goto out;
+	if (fstat(fd, &cst)
+	    || !S_ISREG(cst.st_mode)
+	    || cst.st_uid != geteuid()
+	    || (cst.st_mode & (S_IWGRP | S_IWOTH))
+	    || cst.st_size < sizeof(*h))
+		goto out_fd;
+
+	/* private and writable, in case the application modifies dirent */
+	a = mmap(NULL, cst.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (a == MAP_FAILED)
+		goto out_fd;
+	h = (void *)a;
+	rdu_cache_key(&key, st, gen, shwh);
+	key.npos = h->npos;
+	key.sz = h->sz;
+	if (memcmp(&key, h, sizeof(key))
+	    || sizeof(*h) + h->sz != cst.st_size
+	    || h->sz > RDU_POS_MAX) {
+		rdu_cache_unlink(path, &cst);
+		goto out_unmap;
+	}
+
+	p->npos = h->npos;
+	if (rdu_pos_alloc(p))
+		goto out_unmap;
+	a += sizeof(*h);
+	start = a;
+	end = a + h->sz;
+	for (ul = 0; ul < p->npos; ul++) {
+		de = (void *)a;
+		if (end - a < offsetof(struct dirent64, d_name)
+		    || de->d_reclen < Rdu_DE_LEN(0)
+		    || de->d_reclen > end - a
+		    || de->d_reclen % (1 << RDU_POS_SHIFT)
+		    || !memchr(de->d_name, 0, de->d_reclen
+			       - offsetof(struct dirent64, d_name)))
+			goto out_unmap;
+		p->pos[ul] = (a - start) >> RDU_POS_SHIFT;
+		a += de->d_reclen;
+	}
+	if (a != end)
+		goto out_unmap;
+
+	/* the heap buffer is not necessary anymore */
+	rdu_pool_put(p->ent.e, p->sz);
+	p->map = h;
+	p->map_sz = cst.st_size;
+	p->ent.e = (void *)(h + 1);
+	p->shwh = shwh;
+	err = 0;
+	goto out_fd;
+
+ out_unmap:
+	munmap(h, cst.st_size);
+ out_fd:
+	close(fd);
+ out:
+	DPri("%s, err %d\n", path, err);
+	return err;
+}
+
+/*
+ * returns 1 when the dir was modified very recently, since its timestamps
+ * may not change by the next modification within the granularity of the
+ * clock.
+ */
+int rdu_cache_recent(struct stat *st)
+{
+	struct timespec now;
+
+	return clock_gettime(CLOCK_REALTIME, &now)
+		|| now.tv_sec - st->st_mtim.tv_sec < 2
+		|| now.tv_sec - st->st_ctim.tv_sec < 2;
+}
+
+/*
+ * store the merged entries. failing in it is not an error.
+ * the dir modified very recently is not stored, see rdu_cache_recent().
+ */
+void rdu_cache_store(struct rdu *p, char *dir, struct stat *st, uint32_t gen)
+{
+	static unsigned int nstore;
+	int fd, e;
+	unsigned long long sz;
+	char path[PATH_MAX], tmp[PATH_MAX];
+	struct rdu_cache_hdr h;
+	struct iovec iov[2];
+
+	if (rdu_cache_recent(st))
+		return;
+
+	sz = 0;
+	if (p->npos)
+		sz = ((unsigned long long)p->pos[p->npos - 1] << RDU_POS_SHIFT)
+			+ rdu_pos_de(p, p->npos - 1)->d_reclen;
+	rdu_cache_key(&h, st, gen, p->shwh);
+	h.npos = p->npos;
+	h.sz = sz;
+
+	if (rdu_cache_path(path, dir, st, /*tmp*/0)
+	    || rdu_cache_path(tmp, dir, st, /*tmp*/1))
+		return;
+	e = errno;
+	fd = mkstemp(tmp);
+	if (fd < 0 && errno == ENOENT && !mkdir(dir, 0700)
+	    && !rdu_cache_path(tmp, dir, st, /*tmp*/1))
+		fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	iov[0].iov_base = &h;
+	iov[0].iov_len = sizeof(h);
+	iov[1].iov_base = p->ent.e;
+	iov[1].iov_len = sz;
+	if (writev(fd, iov, 2) != sizeof(h) + sz
+	    || rename(tmp, path))
+		unlink(tmp);
+	else if (!(__atomic_fetch_add(&nstore, 1, __ATOMIC_RELAXED)
+		   % RDU_CACHE_EVICT_INTVL))
+		rdu_cache_evict(dir);
+	close(fd);
+
+ out:
+	errno = e;
+}
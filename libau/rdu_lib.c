@@ -17,20 +17,22 @@
  */
 
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/vfs.h>    /* or <sys/statfs.h> */
 #include <assert.h>
 #include <errno.h>
-#include <search.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "rdu.h"
 
-static struct rdu **rdu;
-#define RDU_STEP 8
-static int rdu_cur, rdu_lim = RDU_STEP;
-
 /* ---------------------------------------------------------------------- */
 
 static int rdu_getent(struct rdu *p, struct aufs_rdu *param)
@@ -47,6 +49,11 @@ static int rdu_getent(struct rdu *p, struct aufs_rdu *param)
 	     param->cookie.generation);
 
 	err = ioctl(p->fd, AUFS_CTL_RDU, param);
+	LibAuStatAdd(rdu_ioctl, 1);
+	if (!err) {
+		LibAuStatAdd(rdu_bytes, param->tail.ul - param->ent.ul);
+		LibAuStatAdd(rdu_ent, param->rent);
+	}
 
 	DPri("param{%llu, %p, %u | %u | %p, %llu, %u, %d |"
 	     " %llu, %d, 0x%x, %u}\n",
@@ -67,125 +74,445 @@ pthread_mutex_t rdu_lib_mtx = PTHREAD_MUTEX_INITIALIZER;
 #endif
 
 /*
- * initialize this library, particularly global variables.
+ * the memory budget for p->ent.
+ * when the environment variable LIBAU_RDU_MEM is set (in bytes, optionally
+ * suffixed by k, m or g), p->ent growing beyond it moves to an unlinked file
+ * in LIBAU_RDU_SPILL (/var/tmp by default), which is mapped and p->map
+ * points to as the shared cache does. the kernel writes the pages back and
+ * drops them under the memory pressure, instead of keeping them as the
+ * anonymous memory. the file is closed at the end of rdu_init(), and the
+ * mapping is released by rdu_cache_unmap().
  */
-int rdu_lib_init(void)
+static unsigned long long rdu_mem(void)
 {
-	int err;
+	unsigned long long ull;
+	char *e, *end;
 
-	err = 0;
-	if (rdu)
+	ull = 0;
+	e = getenv("LIBAU_RDU_MEM");
+	if (!e)
+		goto out;
+
+	ull = strtoull(e, &end, 0);
+	switch (*end) {
+	case 'g':
+	case 'G':
+		ull <<= 10;
+		/*FALLTHROUGH*/
+	case 'm':
+	case 'M':
+		ull <<= 10;
+		/*FALLTHROUGH*/
+	case 'k':
+	case 'K':
+		ull <<= 10;
+	}
+
+ out:
+	return ull;
+}
+
+/*
+ * a small pool of the freed buffers for p->ent and p->pos, to make the
+ * repeated opendir/closedir of the large dirs cheaper.
+ * the buffers grow geometrically and their sizes are always a power of 2,
+ * and at most RDU_POOL_DEPTH buffers are kept for each size up to
+ * RDU_POOL_MAX, and RDU_POOL_CAP bytes in total. the larger ones are freed,
+ * and so are the ones beyond the budget of LIBAU_RDU_MEM.
+ * the entries are taken and put by the atomic operations, so the threads
+ * opening the different dirs don't share a lock.
+ */
+#define RDU_POOL_MIN	13	/* BUFSIZ, 8KB */
+#define RDU_POOL_MAX	20	/* 1MB */
+#define RDU_POOL_DEPTH	2
+#define RDU_POOL_CAP	(4ULL << 20)
+static void *rdu_pool[RDU_POOL_MAX - RDU_POOL_MIN + 1][RDU_POOL_DEPTH];
+static unsigned long long rdu_pool_bytes;
+
+static int rdu_pool_order(unsigned long long sz)
+{
+	int order;
+
+	order = RDU_POOL_MIN;
+	while ((1ULL << order) < sz)
+		order++;
+	return order;
+}
+
+void *rdu_pool_get(unsigned long long *sz)
+{
+	void *buf, **slot;
+	int order, i;
+
+	buf = NULL;
+	order = rdu_pool_order(*sz);
+	*sz = 1ULL << order;
+	if (order <= RDU_POOL_MAX) {
+		slot = rdu_pool[order - RDU_POOL_MIN];
+		for (i = 0; !buf && i < RDU_POOL_DEPTH; i++)
+			if (__atomic_load_n(slot + i, __ATOMIC_RELAXED))
+				buf = __atomic_exchange_n(slot + i, NULL,
+							  __ATOMIC_ACQUIRE);
+	}
+	if (buf)
+		__atomic_sub_fetch(&rdu_pool_bytes, *sz, __ATOMIC_RELAXED);
+	else
+		buf = malloc(*sz);
+	return buf;
+}
+
+void rdu_pool_put(void *buf, unsigned long long sz)
+{
+	void *cur, **slot;
+	int order, i;
+	unsigned long long budget;
+
+	if (!buf)
+		return;
+
+	order = rdu_pool_order(sz);
+	if ((1ULL << order) != sz || order > RDU_POOL_MAX)
+		goto out;
+	budget = rdu_mem();
+	if (budget && sz > budget)
 		goto out;
 
+	if (__atomic_add_fetch(&rdu_pool_bytes, sz, __ATOMIC_RELAXED)
+	    <= RDU_POOL_CAP) {
+		slot = rdu_pool[order - RDU_POOL_MIN];
+		for (i = 0; buf && i < RDU_POOL_DEPTH; i++) {
+			cur = NULL;
+			if (__atomic_compare_exchange_n(slot + i, &cur, buf,
+							/*weak*/0,
+							__ATOMIC_RELEASE,
+							__ATOMIC_RELAXED))
+				buf = NULL;
+		}
+	}
+	if (buf)
+		__atomic_sub_fetch(&rdu_pool_bytes, sz, __ATOMIC_RELAXED);
+
+ out:
+	free(buf);
+}
+
+static int rdu_spill_open(void)
+{
+	int fd;
+	char *dir, path[PATH_MAX];
+
+	dir = getenv("LIBAU_RDU_SPILL");
+	if (!dir || *dir != '/')
+		dir = "/var/tmp";
+
+#ifdef O_TMPFILE
+	fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR))
+		goto out;
+#endif
+	fd = -1;
+	if (snprintf(path, sizeof(path), "%s/.libau.XXXXXX", dir)
+	    >= sizeof(path))
+		goto out;
+	fd = mkostemp(path, O_CLOEXEC);
+	if (fd >= 0)
+		unlink(path);
+
+ out:
+	DPri("%s, fd %d\n", dir, fd);
+	return fd;
+}
+
+/*
+ * grow p->ent to sz bytes, and return the new address. the caller sets
+ * p->ent and p->sz.
+ * when the spill file is unavailable, p->ent stays in the heap.
+ */
+static void *rdu_ent_grow(struct rdu *p, unsigned long long sz)
+{
+	void *a;
+	unsigned long long budget;
+
+	if (!p->map) {
+		budget = rdu_mem();
+		if (!budget || sz <= budget)
+			goto out_realloc;
+		p->spill_fd = rdu_spill_open();
+		if (p->spill_fd < 0)
+			goto out_realloc;
+	}
+
+	/* reserve the blocks, not to get SIGBUS on the full filesystem */
+	if (fallocate(p->spill_fd, 0, 0, sz)
+	    && (errno != EOPNOTSUPP || ftruncate(p->spill_fd, sz)))
+		goto out_fail;
+	if (!p->map) {
+		a = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 p->spill_fd, 0);
+		if (a == MAP_FAILED)
+			goto out_fail;
+		madvise(a, sz, MADV_SEQUENTIAL);
+		memcpy(a, p->ent.e, p->sz);
+		/* not to keep it in the pool beyond the budget */
+		free(p->ent.e);
+		LibAuStatAdd(rdu_spill, 1);
+	} else {
+		a = mremap(p->map, p->map_sz, sz, MREMAP_MAYMOVE);
+		if (a == MAP_FAILED)
+			goto out_fail;
+	}
+	p->map = a;
+	p->map_sz = sz;
+	return a;
+
+ out_fail:
+	if (p->map)
+		return NULL;
+	/* the first spill failed, p->ent is still in the heap */
+	close(p->spill_fd);
+	p->spill_fd = -1;
+ out_realloc:
+	return realloc(p->ent.e, sz);
+}
+
+static void rdu_spill_close(struct rdu *p)
+{
+	if (p->spill_fd >= 0) {
+		close(p->spill_fd);
+		p->spill_fd = -1;
+	}
+}
+
+/*
+ * the table of the DIR streams, indexed by fd.
+ * it is a two-level radix array. the first level grows by doubling, and
+ * the pages in the second level are allocated on demand. neither of them
+ * is freed, so the readers can walk it without any lock, and rdu_lib_mtx is
+ * taken only to grow the table.
+ *
+ * a slot keeps the filesystem type of the stream, so fstatfs(2) is issued
+ * only once per stream, and the type is dropped by closedir(3). the DIR
+ * pointer is kept too, in case the stream was closed by someone else and
+ * the fd was reused. struct rdu in the slot is kept after closedir(3) for
+ * the next stream on the same fd.
+ */
+#define RDU_STEP	8
+#define RDU_PAGE_SHIFT	6
+#define RDU_PAGE_SZ	(1 << RDU_PAGE_SHIFT)
+
+enum {
+	RduFs_UNKNOWN,
+	RduFs_AUFS,
+	RduFs_OTHER
+};
+
+struct rdu_slot {
+	DIR		*dir;
+	int		type;
+	struct rdu	*p;
+} __attribute__((aligned(RDU_CACHELINE)));
+
+struct rdu_page {
+	struct rdu_slot	slot[RDU_PAGE_SZ];
+};
+
+struct rdu_dir {
+	int		npage;
+	struct rdu_page	*page[0];
+};
+
+static struct rdu_dir *rdu_dir;
+
+static struct rdu_slot *rdu_slot_new(int fd)
+{
+	struct rdu_slot *slot;
+	struct rdu_dir *d, *t;
+	struct rdu_page *pg;
+	int i, n;
+
+	slot = NULL;
+	i = fd >> RDU_PAGE_SHIFT;
 	rdu_lib_lock();
-	if (!rdu) {
-		rdu = calloc(rdu_lim, sizeof(*rdu));
-		err = !rdu;
+	d = rdu_dir;
+	if (!d || i >= d->npage) {
+		n = d ? d->npage : RDU_STEP;
+		while (n <= i)
+			n <<= 1;
+		t = calloc(1, sizeof(*t) + n * sizeof(*t->page));
+		if (!t)
+			goto out;
+		t->npage = n;
+		if (d)
+			memcpy(t->page, d->page, d->npage * sizeof(*d->page));
+		/* the old one is not freed since a reader may be walking it */
+		__atomic_store_n(&rdu_dir, t, __ATOMIC_RELEASE);
+		d = t;
 	}
-	rdu_lib_unlock();
+	pg = d->page[i];
+	if (!pg) {
+		if (posix_memalign((void **)&pg, RDU_CACHELINE, sizeof(*pg)))
+			goto out;
+		memset(pg, 0, sizeof(*pg));
+		__atomic_store_n(d->page + i, pg, __ATOMIC_RELEASE);
+	}
+	slot = pg->slot + (fd & (RDU_PAGE_SZ - 1));
 
  out:
-	return err;
+	rdu_lib_unlock();
+	return slot;
 }
 
-static int rdu_append(struct rdu *p)
+static struct rdu_slot *rdu_slot(int fd, int create)
 {
-	int err, i;
-	void *t;
+	struct rdu_dir *d;
+	struct rdu_page *pg;
+	int i;
 
-	rdu_lib_must_lock();
+	assert(fd >= 0);
 
-	err = 0;
-	if (rdu_cur <= rdu_lim - 1)
-		rdu[rdu_cur++] = p;
-	else {
-		t = realloc(rdu, (rdu_lim + RDU_STEP) * sizeof(*rdu));
-		if (t) {
-			rdu = t;
-			rdu_lim += RDU_STEP;
-			rdu[rdu_cur++] = p;
-			for (i = 0; i < RDU_STEP - 1; i++)
-				rdu[rdu_cur + i] = NULL;
-		} else
-			err = -1;
+	i = fd >> RDU_PAGE_SHIFT;
+	d = __atomic_load_n(&rdu_dir, __ATOMIC_ACQUIRE);
+	if (d && i < d->npage) {
+		pg = __atomic_load_n(d->page + i, __ATOMIC_ACQUIRE);
+		if (pg)
+			return pg->slot + (fd & (RDU_PAGE_SZ - 1));
 	}
+	if (create)
+		return rdu_slot_new(fd);
+	return NULL;
+}
 
-	return err;
+/*
+ * returns 1 for aufs, 0 for others, and -1 for an error.
+ * the result is not cached for the fd without DIR stream, since nobody
+ * tells us when it is closed.
+ */
+int rdu_fs_aufs(DIR *dir, int fd)
+{
+	int ret;
+	struct statfs stfs;
+	struct rdu_slot *slot;
+
+	slot = NULL;
+	if (dir)
+		slot = rdu_slot(fd, /*create*/0);
+	if (slot && slot->dir == dir && slot->type != RduFs_UNKNOWN) {
+		ret = (slot->type == RduFs_AUFS);
+		goto out;
+	}
+
+	ret = fstatfs(fd, &stfs);
+	if (ret)
+		goto out;
+	ret = (stfs.f_type == AUFS_SUPER_MAGIC);
+	if (!dir)
+		goto out;
+
+	/* failing in caching is not an error */
+	slot = rdu_slot(fd, /*create*/1);
+	if (slot) {
+		slot->dir = dir;
+		slot->type = ret ? RduFs_AUFS : RduFs_OTHER;
+	}
+
+ out:
+	return ret;
+}
+
+/* returns 1 when the stream was known as aufs */
+static int rdu_fs_drop(DIR *dir, int fd)
+{
+	int ret;
+	struct rdu_slot *slot;
+
+	ret = 0;
+	slot = rdu_slot(fd, /*create*/0);
+	if (slot && slot->dir == dir) {
+		ret = (slot->type == RduFs_AUFS);
+		slot->dir = NULL;
+		slot->type = RduFs_UNKNOWN;
+	}
+
+	return ret;
 }
 
 /* ---------------------------------------------------------------------- */
 
-static struct rdu *rdu_new(int fd)
+static struct rdu *rdu_new(void)
 {
 	struct rdu *p;
-	int err;
 
-	p = malloc(sizeof(*p));
+	if (posix_memalign((void **)&p, RDU_CACHELINE, sizeof(*p)))
+		p = NULL;
 	if (p) {
 		rdu_rwlock_init(p);
-		p->fd = fd;
+		p->fd = -1;
 		p->de = NULL;
 		p->pos = NULL;
+		p->pos_sz = 0;
 		p->sz = BUFSIZ;
 		p->ent.e = NULL;
-		err = rdu_append(p);
-		if (!err)
-			goto out; /* success */
+		p->map = NULL;
+		p->map_sz = 0;
+		p->spill_fd = -1;
+		p->key.valid = 0;
+		p->stream = NULL;
+		p->base = 0;
+		p->eof = 0;
 	}
-	free(p);
-	p = NULL;
 
- out:
 	return p;
 }
 
 struct rdu *rdu_buf_lock(int fd)
 {
-	struct rdu *p;
-	int i;
-
-	assert(fd >= 0);
+	struct rdu *p, *cur;
+	struct rdu_slot *slot;
 
 	p = NULL;
-	rdu_lib_lock();
-	if (!rdu)
+	slot = rdu_slot(fd, /*create*/1);
+	if (!slot)
 		goto out;
-	for (i = 0; i < rdu_cur; i++)
-		if (rdu[i] && rdu[i]->fd == fd) {
-			p = rdu[i];
-			goto out;
-		}
 
-	for (i = 0; i < rdu_cur; i++)
-		if (rdu[i] && rdu[i]->fd == -1) {
-			p = rdu[i];
-			p->fd = fd;
+	p = __atomic_load_n(&slot->p, __ATOMIC_ACQUIRE);
+	if (!p) {
+		p = rdu_new();
+		if (!p)
 			goto out;
-		}
-	if (!p)
-		p = rdu_new(fd);
-
- out:
-	rdu_lib_unlock();
-	if (p) {
-		rdu_write_lock(p);
-		if (p->fd < 0) {
-			rdu_unlock(p);
-			p = NULL;
+		cur = NULL;
+		if (!__atomic_compare_exchange_n(&slot->p, &cur, p, /*weak*/0,
+						 __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			free(p);
+			p = cur;
 		}
 	}
 
+	rdu_write_lock(p);
+	p->fd = fd;
+
+ out:
 	return p;
 }
 
+static void rdu_stream_free(struct rdu *p);
+
 void rdu_free(struct rdu *p)
 {
 	assert(p);
 
 	p->fd = -1;
-	free(p->pos);
-	free(p->ent.e);
+	/* p->sz is kept as a hint for the next stream */
+	rdu_pool_put(p->pos, p->pos_sz);
+	if (p->map)
+		rdu_cache_unmap(p);
+	else
+		rdu_pool_put(p->ent.e, p->sz);
+	rdu_stream_free(p);
 	free(p->de);
+	p->key.valid = 0;
+	p->base = 0;
+	p->pos_sz = 0;
 	p->de = NULL;
 	p->pos = NULL;
 	p->ent.e = NULL;
@@ -195,99 +522,254 @@ void rdu_free(struct rdu *p)
 /* ---------------------------------------------------------------------- */
 /* the heart of this library */
 
-static int do_store; /* a dirty interface of tsearch(3) */
 static void rdu_store(struct rdu *p, struct au_rdu_ent *ent)
 {
 	/* DPri("%s\n", ent->name); */
-	p->pos[p->idx++] = ent;
+	p->pos[p->idx++] = rdu_pos_off(p, ent);
 }
 
-static int rdu_ent_compar(const void *_a, const void *_b)
-{
-	int ret;
-	const struct au_rdu_ent *a = _a, *b = _b;
+/*
+ * a hash table to drop the duplicated names and the whiteouted ones.
+ * it is an open addressing table with linear probing, and the bloom filter
+ * for the whiteouts follows it in the same allocation. the key is the name
+ * (without the whiteout prefix) and whether it is a whiteout or not. an
+ * entry is referred by its offset from the base, which is p->ent usually,
+ * or the name set in the streaming mode.
+ * the entries are processed in the order of the branches, since a whiteout
+ * hides the entries on the lower branches only.
+ */
+struct rdu_hslot {
+	uint32_t	hash;
+	uint32_t	off;	/* in 8 bytes, plus 1 */
+};
 
-	ret = strcmp(a->name, b->name);
-	do_store = !!ret;
+struct rdu_htable {
+	unsigned long long	mask, bmask, n;
+	struct rdu_hslot	*slot;
+	unsigned char		*bloom;
+};
 
-	/* DPri("%s, %s, %d\n", a->name, b->name, ret); */
-	return ret;
+#define RDU_WH_HASH	0x9e3779b9U
+
+static int rdu_hinit(struct rdu_htable *t, unsigned long long n)
+{
+	unsigned long long sz, bsz;
+
+	/* keep the load factor less than 1/2 */
+	sz = 16;
+	while (sz < 2 * n)
+		sz <<= 1;
+	/* 8 bits per entry */
+	bsz = sz / 2;
+
+	t->mask = sz - 1;
+	t->bmask = bsz * 8 - 1;
+	t->n = 0;
+	t->slot = calloc(1, sz * sizeof(*t->slot) + bsz);
+	if (!t->slot)
+		return -1;
+	t->bloom = (void *)(t->slot + sz);
+	return 0;
 }
 
-static int rdu_ent_compar_wh1(const void *_a, const void *_b)
+static uint32_t rdu_hash(const char *name, int len)
 {
-	int ret;
-	const struct au_rdu_ent *a = _a, *b = _b;
+	uint32_t h;
 
-	if (a->nlen <= AUFS_WH_PFX_LEN
-	    || memcmp(a->name, AUFS_WH_PFX, AUFS_WH_PFX_LEN))
-		ret = strcmp(a->name, b->name + AUFS_WH_PFX_LEN);
-	else
-		ret = strcmp(a->name + AUFS_WH_PFX_LEN, b->name);
+	/* FNV-1a */
+	h = 2166136261U;
+	while (len-- > 0) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
 
-	/* DPri("%s, %s, %d\n", a->name, b->name, ret); */
-	return ret;
+static void rdu_bloom_set(struct rdu_htable *t, uint32_t h)
+{
+	unsigned long long b;
+
+	b = h & t->bmask;
+	t->bloom[b / 8] |= 1 << (b % 8);
+	b = (h >> 16 | (unsigned long long)h << 16) & t->bmask;
+	t->bloom[b / 8] |= 1 << (b % 8);
 }
 
-static int rdu_ent_compar_wh2(const void *_a, const void *_b)
+static int rdu_bloom_test(struct rdu_htable *t, uint32_t h)
 {
-	int ret;
-	const struct au_rdu_ent *a = _a, *b = _b;
+	unsigned long long b, c;
 
-	ret = strcmp(a->name + AUFS_WH_PFX_LEN,
-		     b->name + AUFS_WH_PFX_LEN);
-	do_store = !!ret;
+	b = h & t->bmask;
+	c = (h >> 16 | (unsigned long long)h << 16) & t->bmask;
+	return (t->bloom[b / 8] & (1 << (b % 8)))
+		&& (t->bloom[c / 8] & (1 << (c % 8)));
+}
 
-	/* DPri("%s, %s, %d\n", a->name, b->name, ret); */
-	return ret;
+static char *rdu_key(struct au_rdu_ent *e, int *len)
+{
+	if (!e->wh) {
+		*len = e->nlen;
+		return e->name;
+	}
+	*len = e->nlen - AUFS_WH_PFX_LEN;
+	return e->name + AUFS_WH_PFX_LEN;
 }
 
-static int rdu_ent_append(struct rdu *p, struct au_rdu_ent *ent)
+/* double the table, for the streaming mode */
+static int rdu_hgrow(struct rdu_htable *t, unsigned long long base)
 {
 	int err;
+	unsigned long long ul, i;
+	struct rdu_htable n;
+	struct rdu_hslot *slot;
+	union au_rdu_ent_ul u;
 
-	err = 0;
-	if (tfind(ent, (void *)&p->wh, rdu_ent_compar_wh1))
+	err = rdu_hinit(&n, t->mask + 1);
+	if (err)
 		goto out;
 
-	if (tsearch(ent, (void *)&p->real, rdu_ent_compar)) {
-		if (do_store)
-			rdu_store(p, ent);
-	} else
-		err = -1;
+	for (ul = 0; ul <= t->mask; ul++) {
+		slot = t->slot + ul;
+		if (!slot->off)
+			continue;
+		for (i = slot->hash & n.mask; n.slot[i].off; i = (i + 1) & n.mask)
+			;
+		n.slot[i] = *slot;
+		u.ul = base + (unsigned long long)(slot->off - 1) * 8;
+		if (u.e->wh)
+			rdu_bloom_set(&n, slot->hash ^ RDU_WH_HASH);
+	}
+	n.n = t->n;
+	free(t->slot);
+	*t = n;
 
  out:
 	return err;
 }
 
-static int rdu_ent_append_wh(struct rdu *p, struct au_rdu_ent *ent)
+/*
+ * search the entry whose key is same to e.
+ * returns 1 if found, otherwise 0 after inserting e when want_ins is set.
+ */
+static int rdu_hsearch(struct rdu_htable *t, unsigned long long base,
+		       struct au_rdu_ent *e, int wh, uint32_t h, int want_ins)
 {
-	int err;
+	unsigned long long i;
+	int len, l;
+	char *name, *n;
+	struct rdu_hslot *slot;
+	union au_rdu_ent_ul u;
 
-	err = 0;
-	ent->wh = 1;
-	if (tsearch(ent, (void *)&p->wh, rdu_ent_compar_wh2)) {
-		if (p->shwh && do_store)
-			rdu_store(p, ent);
-	} else
-		err = -1;
+	name = rdu_key(e, &len);
+	/* distinguish the whiteout from the real entry */
+	h ^= wh ? RDU_WH_HASH : 0;
+	for (i = h & t->mask; ; i = (i + 1) & t->mask) {
+		slot = t->slot + i;
+		if (!slot->off)
+			break;
+		if (slot->hash != h)
+			continue;
+		u.ul = base + (unsigned long long)(slot->off - 1) * 8;
+		if (u.e->wh != wh)
+			continue;
+		n = rdu_key(u.e, &l);
+		if (l == len && !memcmp(n, name, len))
+			return 1;
+	}
 
-	return err;
+	if (want_ins) {
+		u.e = e;
+		i = (u.ul - base) / 8;
+		assert(i < UINT32_MAX);
+		slot->hash = h;
+		slot->off = i + 1;
+		t->n++;
+	}
+	return 0;
+}
+
+/*
+ * add e, which is located after base, to the table. when want_ins is not
+ * set, e is tested only and it may be located anywhere.
+ * returns 1 if e is added, 0 if it is a duplicated or whiteouted name, and
+ * -1 for an error.
+ */
+static int rdu_hadd(struct rdu_htable *t, unsigned long long base,
+		    struct au_rdu_ent *e, int want_ins)
+{
+	int len;
+	uint32_t h;
+	char *name;
+
+	if (want_ins && 2 * (t->n + 1) > t->mask + 1 && rdu_hgrow(t, base))
+		return -1;
+
+	/* DPri("%s\n", e->name); */
+	e->wh = (e->nlen > AUFS_WH_PFX_LEN
+		 && !memcmp(e->name, AUFS_WH_PFX, AUFS_WH_PFX_LEN));
+	name = rdu_key(e, &len);
+	h = rdu_hash(name, len);
+	if (e->wh)
+		LibAuStatAdd(rdu_wh, 1);
+	if (!e->wh)
+		return !(rdu_bloom_test(t, h)
+			 && rdu_hsearch(t, base, e, /*wh*/1, h, /*want_ins*/0))
+			&& !rdu_hsearch(t, base, e, /*wh*/0, h, want_ins);
+	if (rdu_hsearch(t, base, e, /*wh*/1, h, want_ins))
+		return 0;
+	if (want_ins)
+		rdu_bloom_set(t, h);
+	return 1;
+}
+
+int rdu_pos_alloc(struct rdu *p)
+{
+	if (p->sz > RDU_POS_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	if (p->pos_sz < sizeof(*p->pos) * p->npos) {
+		rdu_pool_put(p->pos, p->pos_sz);
+		p->pos_sz = sizeof(*p->pos) * p->npos;
+		p->pos = rdu_pool_get(&p->pos_sz);
+		if (!p->pos) {
+			p->pos_sz = 0;
+			return -1;
+		}
+	}
+	return 0;
 }
 
-static void rdu_tfree(void *node)
+/* move the stored entries to the head of p->ent */
+static void rdu_compact(struct rdu *p)
 {
-	/* empty */
+	unsigned long long ul;
+	union au_rdu_ent_ul u;
+
+	p->npos = p->idx;
+	u = p->ent;
+	for (ul = 0; ul < p->npos; ul++) {
+		if (rdu_pos_ent(p, ul) != u.e)
+			break;
+		u.ul += au_rdu_len(u.e->nlen);
+	}
+	for (; ul < p->npos; ul++) {
+		memmove(u.e, rdu_pos_ent(p, ul),
+			au_rdu_len(rdu_pos_ent(p, ul)->nlen));
+		p->pos[ul] = rdu_pos_off(p, u.e);
+		u.ul += au_rdu_len(u.e->nlen);
+	}
 }
 
 static int rdu_merge(struct rdu *p)
 {
 	int err;
-	unsigned long long ul;
+	unsigned long long ul, ns;
 	union au_rdu_ent_ul u;
-	void *t;
+	struct rdu_htable t;
 
 	err = -1;
+	ns = libau_stat_ns();
 #if 0
 	u = p->ent;
 	for (ul = 0; ul < p->npos; ul++) {
@@ -296,82 +778,790 @@ static int rdu_merge(struct rdu *p)
 	}
 #endif
 
-	p->pos = realloc(p->pos, sizeof(*p->pos) * p->npos);
-	if (!p->pos)
+	err = rdu_pos_alloc(p);
+	if (err)
+		goto out;
+	err = rdu_hinit(&t, p->npos);
+	if (err)
 		goto out;
 
-	err = 0;
 	p->idx = 0;
-	p->real = NULL;
-	p->wh = NULL;
 	u = p->ent;
-	for (ul = 0; !err && ul < p->npos; ul++) {
-		/* DPri("%s\n", u.e->name); */
-		u.e->wh = 0;
-		do_store = 1;
-		if (u.e->nlen <= AUFS_WH_PFX_LEN
-		    || memcmp(u.e->name, AUFS_WH_PFX, AUFS_WH_PFX_LEN))
-			err = rdu_ent_append(p, u.e);
-		else
-			err = rdu_ent_append_wh(p, u.e);
+	for (ul = 0; ul < p->npos; ul++) {
+		if (rdu_hadd(&t, p->ent.ul, u.e, /*want_ins*/1) > 0
+		    && (!u.e->wh || p->shwh))
+			rdu_store(p, u.e);
 		u.ul += au_rdu_len(u.e->nlen);
 	}
-	tdestroy(p->real, rdu_tfree);
-	tdestroy(p->wh, rdu_tfree);
-	if (err) {
-		free(p->pos);
-		p->pos = NULL;
+	free(t.slot);
+	LibAuStatAdd(rdu_drop, p->npos - p->idx);
+	if (p->idx != p->npos)
+		rdu_compact(p);
+	if (ns)
+		LibAuStatAdd(rdu_merge_ns, libau_stat_ns() - ns);
+
+ out:
+	return err;
+}
+
+/*
+ * lay the merged entries out in struct dirent64 in place, so that
+ * readdir(3) can return them without copying.
+ * a record in dirent64 is never shorter than au_rdu_ent, so the records are
+ * moved from the last one backwards.
+ */
+static int rdu_de(struct rdu *p)
+{
+	unsigned long long ul, sz, n;
+	union au_rdu_ent_ul u;
+	struct au_rdu_ent *ent;
+	struct dirent64 *de;
+	uint64_t ino;
+	uint8_t type, nlen;
+	void *t;
+
+	sz = 0;
+	for (ul = 0; ul < p->npos; ul++)
+		sz += Rdu_DE_LEN(rdu_pos_ent(p, ul)->nlen);
+	if (sz > RDU_POS_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	/* the offsets in p->pos survive realloc */
+	if (sz > p->sz) {
+		n = 1ULL << rdu_pool_order(sz);
+		t = rdu_ent_grow(p, n);
+		if (!t)
+			return -1;
+		p->ent.e = t;
+		p->sz = n;
+	}
+
+	u.ul = p->ent.ul + sz;
+	for (ul = p->npos; ul-- > 0; ) {
+		ent = rdu_pos_ent(p, ul);
+		ino = ent->ino;
+		type = ent->type;
+		nlen = ent->nlen;
+		u.ul -= Rdu_DE_LEN(nlen);
+		de = (void *)u.e;
+		memmove(de->d_name, ent->name, nlen + 1);
+		de->d_ino = ino;
+		de->d_off = p->base + ul;
+		de->d_reclen = Rdu_DE_LEN(nlen);
+		de->d_type = type;
+		p->pos[ul] = rdu_pos_off(p, de);
+	}
+
+	return 0;
+}
+
+/*
+ * the names-only mode.
+ * the environment variable LIBAU_RDU_NOINO is a list of the program names
+ * separated by ':', or "all". for the listed programs, AUFS_CTL_RDU_INO is
+ * skipped and d_ino is the inode number on the branch, which is enough for
+ * the programs never looking at d_ino.
+ */
+static int rdu_noino(void)
+{
+	int l;
+	char *e, *p;
+
+	e = getenv("LIBAU_RDU_NOINO");
+	if (!e || !*e)
+		return 0;
+	if (!strcasecmp(e, "all"))
+		return 1;
+
+	l = strlen(program_invocation_short_name);
+	while (*e) {
+		p = strchrnul(e, ':');
+		if (p - e == l && !strncmp(e, program_invocation_short_name, l))
+			return 1;
+		e = p;
+		if (*e)
+			e++;
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * the streaming mode, enabled by the environment variable LIBAU_RDU_STREAM.
+ * a chunk from AUFS_CTL_RDU is merged and returned before the next one is
+ * fetched, so the first entry comes without reading all the branches.
+ * the names which may hide the later entries are kept in the name set, the
+ * copies of au_rdu_ent and the hash table, and p->ent holds the current
+ * chunk only. the names in the last branch of aufs hide nothing, and they
+ * are tested but not kept. p->base is the position of the first entry in p->ent, and
+ * seeking backward restarts the stream.
+ */
+#define RDU_STREAM_SZ	(1ULL << 16)
+
+struct rdu_stream {
+	struct au_rdu_cookie	cookie;
+	unsigned int		blk;
+	int			eof, noino, bbot;
+
+	struct rdu_htable	t;
+	union au_rdu_ent_ul	set;
+	unsigned long long	len, sz;
+};
+
+static int rdu_stream_on(void)
+{
+	char *t;
+
+	t = getenv("LIBAU_RDU_STREAM");
+	return t && *t && strcmp(t, "0");
+}
+
+static void rdu_stream_free(struct rdu *p)
+{
+	struct rdu_stream *s;
+
+	s = p->stream;
+	if (s) {
+		free(s->t.slot);
+		free(s->set.e);
+		free(s);
+		p->stream = NULL;
+	}
+}
+
+/*
+ * copy e to the name set, unless it is in the last branch.
+ * returns 1 if e should be listed, 0 if not, and -1 for an error.
+ */
+static int rdu_stream_add(struct rdu *p, struct rdu_stream *s,
+			  struct au_rdu_ent *e)
+{
+	int ret;
+	unsigned long long len, sz;
+	union au_rdu_ent_ul u;
+	void *t;
+
+	if (e->bindex == s->bbot) {
+		ret = rdu_hadd(&s->t, s->set.ul, e, /*want_ins*/0);
+		if (ret > 0)
+			ret = !e->wh || p->shwh;
+		return ret;
+	}
+
+	len = au_rdu_len(e->nlen);
+	if (s->len + len > s->sz) {
+		sz = s->sz ? s->sz : BUFSIZ;
+		while (sz < s->len + len)
+			sz <<= 1;
+		t = realloc(s->set.e, sz);
+		if (!t)
+			return -1;
+		s->set.e = t;
+		s->sz = sz;
+	}
+
+	u.ul = s->set.ul + s->len;
+	memcpy(u.e, e, len);
+	ret = rdu_hadd(&s->t, s->set.ul, u.e, /*want_ins*/1);
+	if (ret > 0) {
+		s->len += len;
+		ret = !u.e->wh || p->shwh;
+	}
+	return ret;
+}
+
+/* fetch the next chunk, and merge it */
+static int rdu_stream_next(struct rdu *p)
+{
+	int err;
+	unsigned long long ul, ns;
+	struct aufs_rdu param;
+	struct rdu_stream *s;
+	union au_rdu_ent_ul u;
+
+	s = p->stream;
+	memset(&param, 0, sizeof(param));
+	param.verify[AufsCtlRduV_SZ] = sizeof(param);
+	param.sz = p->sz;
+	if (param.sz > RDU_STREAM_SZ)
+		param.sz = RDU_STREAM_SZ;
+	param.ent = p->ent;
+	param.tail = param.ent;
+	param.blk = s->blk;
+	param.cookie = s->cookie;
+	err = rdu_getent(p, &param);
+	if (err)
+		goto out;
+	s->cookie = param.cookie;
+	p->shwh = param.shwh;
+	if (!param.rent) {
+		s->eof = 1;
 		goto out;
-	} else if (p->idx == p->npos)
-		goto out; /* success */
+	}
 
-	p->npos = p->idx;
-	/* t == NULL is not an error */
-	t = realloc(p->pos, sizeof(*p->pos) * p->idx);
+	p->base += p->npos;
+	p->npos = param.rent;
+	err = rdu_pos_alloc(p);
+	if (err)
+		goto out;
+	ns = libau_stat_ns();
+	p->idx = 0;
+	u = p->ent;
+	for (ul = 0; ul < param.rent; ul++) {
+		err = rdu_stream_add(p, s, u.e);
+		if (err < 0)
+			goto out;
+		if (err)
+			rdu_store(p, u.e);
+		u.ul += au_rdu_len(u.e->nlen);
+	}
+	err = 0;
+	LibAuStatAdd(rdu_drop, param.rent - p->idx);
+	rdu_compact(p);
+	if (ns)
+		LibAuStatAdd(rdu_merge_ns, libau_stat_ns() - ns);
+	if (!p->npos)
+		goto out;
+
+	if (!s->noino) {
+		param.ent = p->ent;
+		param.nent = p->npos;
+		err = ioctl(p->fd, AUFS_CTL_RDU_INO, &param);
+		LibAuStatAdd(rdu_ino_ioctl, 1);
+	}
+	if (!err)
+		err = rdu_de(p);
+
+ out:
+	return err;
+}
+
+static int rdu_stream_start(struct rdu *p)
+{
+	int err;
+	struct rdu_stream *s;
+	char *t;
+
+	err = -1;
+	s = p->stream;
+	if (!s) {
+		s = calloc(1, sizeof(*s));
+		if (!s)
+			goto out;
+		p->stream = s;
+	}
+	free(s->t.slot);
+	err = rdu_hinit(&s->t, 0);
+	if (err) {
+		s->t.slot = NULL;
+		goto out;
+	}
+	memset(&s->cookie, 0, sizeof(s->cookie));
+	s->eof = 0;
+	s->noino = rdu_noino();
+	/* the last branch of aufs, or -1 which never matches */
+	s->bbot = ioctl(p->fd, AUFS_CTL_BRINFO, NULL);
+	if (s->bbot > 0)
+		s->bbot--;
+	else
+		s->bbot = -1;
+	s->len = 0;
+	s->blk = 0;
+	t = getenv("AUFS_RDU_BLK");
 	if (t)
-		p->pos = t;
+		s->blk = strtoul(t, NULL, 0);
 
-	u = p->ent;
-	for (ul = 0; ul < p->npos; ul++) {
-		if (p->pos[ul] != u.e)
+	p->base = 0;
+	p->npos = 0;
+	do
+		err = rdu_stream_next(p);
+	while (!err && !p->npos && !s->eof);
+
+ out:
+	return err;
+}
+
+/*
+ * the pipelined mode, enabled by the environment variable LIBAU_RDU_PIPE.
+ * a helper thread issues AUFS_CTL_RDU into two chunks alternately, while
+ * the caller appends the filled chunk to p->ent and merges it, so that
+ * merging overlaps with the kernel filling the next chunk. the entries are
+ * merged in the order of the branches as rdu_merge() does.
+ * note that the helper thread is created in the program which preloads
+ * libau, and it lives during rdu_init() only. it blocks all the signals,
+ * not to take the ones for the program.
+ * it is worth for the huge dirs on the multi-core machines only.
+ */
+#define RDU_PIPE_SZ	(1ULL << 18)
+
+#ifdef _REENTRANT
+struct rdu_chunk {
+	union au_rdu_ent_ul	ent;
+	unsigned long long	len, rent;
+	int			filled, shwh;
+};
+
+struct rdu_pipe {
+	pthread_mutex_t		mtx;
+	pthread_cond_t		cond;
+	int			eof, stop, err;
+
+	struct rdu		*p;
+	struct aufs_rdu		param;
+	unsigned long long	sz;
+	struct rdu_chunk	chunk[2];
+};
+
+static int rdu_pipe_on(void)
+{
+	char *t;
+
+	t = getenv("LIBAU_RDU_PIPE");
+	return t && *t && strcmp(t, "0");
+}
+
+static void *rdu_pipe_fetch(void *arg)
+{
+	int err, i, stop;
+	struct rdu_pipe *pp = arg;
+	struct aufs_rdu *param = &pp->param;
+	struct rdu_chunk *c;
+
+	i = 0;
+	while (1) {
+		c = pp->chunk + i;
+		pthread_mutex_lock(&pp->mtx);
+		while (c->filled && !pp->stop)
+			pthread_cond_wait(&pp->cond, &pp->mtx);
+		stop = pp->stop;
+		pthread_mutex_unlock(&pp->mtx);
+		if (stop)
 			break;
-		u.ul += au_rdu_len(u.e->nlen);
+
+		param->sz = pp->sz;
+		param->ent = c->ent;
+		param->tail = param->ent;
+		param->full = 0;
+		err = rdu_getent(pp->p, param);
+
+		pthread_mutex_lock(&pp->mtx);
+		if (err) {
+			pp->err = errno;
+			pp->eof = 1;
+		} else if (!param->rent && param->full) {
+			/* blk is larger than the chunk */
+			pp->err = ENOBUFS;
+			pp->eof = 1;
+		} else {
+			c->len = param->tail.ul - param->ent.ul;
+			c->rent = param->rent;
+			c->shwh = param->shwh;
+			c->filled = 1;
+			pp->eof = !param->rent;
+		}
+		pthread_cond_broadcast(&pp->cond);
+		pthread_mutex_unlock(&pp->mtx);
+		if (pp->eof)
+			break;
+		i ^= 1;
 	}
-	for (; ul < p->npos; ul++) {
-		memmove(u.e, p->pos[ul], au_rdu_len(p->pos[ul]->nlen));
-		p->pos[ul] = u.e;
+
+	return NULL;
+}
+
+/* grow p->pos keeping the stored offsets, unlike rdu_pos_alloc() */
+static int rdu_pipe_pos(struct rdu *p)
+{
+	unsigned long long sz;
+	uint32_t *pos;
+
+	if (p->sz > RDU_POS_MAX) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	if (p->pos_sz >= sizeof(*p->pos) * p->npos)
+		return 0;
+
+	sz = sizeof(*p->pos) * p->npos;
+	pos = rdu_pool_get(&sz);
+	if (!pos)
+		return -1;
+	if (p->idx)
+		memcpy(pos, p->pos, sizeof(*p->pos) * p->idx);
+	rdu_pool_put(p->pos, p->pos_sz);
+	p->pos = pos;
+	p->pos_sz = sz;
+	return 0;
+}
+
+/* append the chunk to p->ent */
+static int rdu_pipe_append(struct rdu *p, struct rdu_chunk *c,
+			   unsigned long long used)
+{
+	unsigned long long sz;
+	void *e;
+
+	if (used + c->len > p->sz) {
+		sz = p->sz << 1;
+		while (sz < used + c->len)
+			sz <<= 1;
+		e = rdu_ent_grow(p, sz);
+		if (!e)
+			return -1;
+		p->ent.e = e;
+		p->sz = sz;
+	}
+	memcpy((char *)p->ent.e + used, c->ent.e, c->len);
+	return 0;
+}
+
+/* merge the rent entries at p->ent + used */
+static int rdu_pipe_merge(struct rdu *p, struct rdu_htable *t,
+			  unsigned long long used, unsigned long long rent)
+{
+	int err;
+	unsigned long long ul;
+	union au_rdu_ent_ul u;
+
+	p->npos += rent;
+	err = rdu_pipe_pos(p);
+	if (err)
+		goto out;
+
+	u.ul = p->ent.ul + used;
+	for (ul = 0; ul < rent; ul++) {
+		err = rdu_hadd(t, p->ent.ul, u.e, /*want_ins*/1);
+		if (err < 0)
+			goto out;
+		if (err && (!u.e->wh || p->shwh))
+			rdu_store(p, u.e);
 		u.ul += au_rdu_len(u.e->nlen);
 	}
+	err = 0;
 
  out:
 	return err;
 }
 
-int rdu_init(struct rdu *p, int want_de)
+static int rdu_pipe(struct rdu *p, struct aufs_rdu *param)
+{
+	int err, e, i;
+	unsigned long long used, rent, len, ns, merge_ns;
+	pthread_t th;
+	sigset_t set, oldset;
+	struct rdu_pipe pp;
+	struct rdu_chunk *c;
+	struct rdu_htable t;
+
+	err = -1;
+	memset(&pp, 0, sizeof(pp));
+	pp.p = p;
+	pp.param = *param;
+	pp.sz = RDU_PIPE_SZ;
+	if (pp.sz < 2 * param->blk)
+		pp.sz = 2 * param->blk;
+	for (i = 0; i < 2; i++) {
+		pp.chunk[i].ent.e = rdu_pool_get(&pp.sz);
+		if (!pp.chunk[i].ent.e)
+			goto out_chunk;
+	}
+	/* the size of the previous listing hints the number of entries */
+	if (rdu_hinit(&t, p->sz / au_rdu_len(NAME_MAX / 16)))
+		goto out_chunk;
+	pthread_mutex_init(&pp.mtx, NULL);
+	pthread_cond_init(&pp.cond, NULL);
+	/* the new thread inherits the signal mask */
+	sigfillset(&set);
+	pthread_sigmask(SIG_SETMASK, &set, &oldset);
+	e = pthread_create(&th, NULL, rdu_pipe_fetch, &pp);
+	pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+	errno = e;
+	if (errno)
+		goto out_hash;
+
+	p->npos = 0;
+	p->idx = 0;
+	used = 0;
+	merge_ns = 0;
+	i = 0;
+	while (1) {
+		c = pp.chunk + i;
+		pthread_mutex_lock(&pp.mtx);
+		while (!c->filled && !pp.eof)
+			pthread_cond_wait(&pp.cond, &pp.mtx);
+		e = pp.err;
+		pthread_mutex_unlock(&pp.mtx);
+		if (!c->filled) {
+			errno = e;
+			err = -1;
+			break;
+		}
+
+		/* the chunk is refilled after released */
+		rent = c->rent;
+		len = c->len;
+		err = 0;
+		if (rent)
+			err = rdu_pipe_append(p, c, used);
+		p->shwh = c->shwh;
+		pthread_mutex_lock(&pp.mtx);
+		c->filled = 0;
+		pthread_cond_broadcast(&pp.cond);
+		pthread_mutex_unlock(&pp.mtx);
+		if (err || !rent)
+			break;
+
+		ns = libau_stat_ns();
+		err = rdu_pipe_merge(p, &t, used, rent);
+		if (ns)
+			merge_ns += libau_stat_ns() - ns;
+		if (err)
+			break;
+		used += len;
+		i ^= 1;
+	}
+
+	e = errno;
+	pthread_mutex_lock(&pp.mtx);
+	pp.stop = 1;
+	pthread_cond_broadcast(&pp.cond);
+	pthread_mutex_unlock(&pp.mtx);
+	pthread_join(th, NULL);
+	errno = e;
+
+	if (!err) {
+		param->cookie = pp.param.cookie;
+		param->shwh = pp.param.shwh;
+		LibAuStatAdd(rdu_drop, p->npos - p->idx);
+		if (p->idx != p->npos)
+			rdu_compact(p);
+		LibAuStatAdd(rdu_merge_ns, merge_ns);
+	}
+
+ out_hash:
+	pthread_cond_destroy(&pp.cond);
+	pthread_mutex_destroy(&pp.mtx);
+	free(t.slot);
+ out_chunk:
+	e = errno;
+	for (i = 0; i < 2; i++)
+		rdu_pool_put(pp.chunk[i].ent.e, pp.sz);
+	errno = e;
+	return err;
+}
+#else
+static int rdu_pipe_on(void)
+{
+	return 0;
+}
+
+static int rdu_pipe(struct rdu *p, struct aufs_rdu *param)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif /* _REENTRANT */
+
+/* returns 0 when pos is in p->pos, 1 for the end, or -1 for an error */
+int rdu_more(struct rdu *p, unsigned long long pos)
+{
+	int err;
+	struct rdu_stream *s;
+
+	err = 0;
+	s = p->stream;
+	if (s) {
+		if (pos < p->base)
+			err = rdu_stream_start(p);
+		while (!err && pos >= p->base + p->npos && !s->eof)
+			err = rdu_stream_next(p);
+	}
+	if (!err && (pos < p->base || pos >= p->base + p->npos))
+		err = 1;
+	return err;
+}
+
+/*
+ * get the generation of aufs and the shwh option by the smallest listing,
+ * to validate the shared cache.
+ */
+static int rdu_gen(struct rdu *p, uint32_t *gen, int *shwh)
 {
 	int err;
-	unsigned long long used;
 	struct aufs_rdu param;
-	char *t;
-	struct au_rdu_ent *e;
+	union {
+		struct au_rdu_ent e;
+		char a[sizeof(struct au_rdu_ent) + NAME_MAX + 8];
+	} buf;
 
 	memset(&param, 0, sizeof(param));
 	param.verify[AufsCtlRduV_SZ] = sizeof(param);
-	param.sz = p->sz;
-	param.ent = p->ent;
+	param.sz = sizeof(buf);
+	param.ent.e = &buf.e;
 	param.tail = param.ent;
-	if (!param.ent.e) {
+	err = rdu_getent(p, &param);
+	if (!err) {
+		*gen = param.cookie.generation;
+		*shwh = param.shwh;
+	}
+	return err;
+}
+
+/*
+ * the merged entries are kept until closedir(3), and rewinddir(3) or
+ * seekdir(3) to 0 reuses them while the dir and the branches are unchanged.
+ * the dir is identified too, since getdents(2) on a bare fd has no
+ * closedir(3) to drop them.
+ * the key is not set for the dir modified very recently, as the shared
+ * cache, see rdu_cache_recent().
+ */
+static void rdu_key_set(struct rdu *p, struct stat *st, uint32_t gen,
+			int noino)
+{
+	struct rdu_key *k = &p->key;
+
+	k->valid = !rdu_cache_recent(st);
+	k->shwh = p->shwh;
+	k->noino = noino;
+	k->gen = gen;
+	k->dev = st->st_dev;
+	k->ino = st->st_ino;
+	k->size = st->st_size;
+	k->nlink = st->st_nlink;
+	k->mtime = st->st_mtim;
+	k->ctime = st->st_ctim;
+}
+
+static int rdu_key_match(struct rdu_key *k, struct stat *st, uint32_t gen,
+			 int shwh)
+{
+	return k->gen == gen
+		&& k->shwh == shwh
+		&& (!k->noino || rdu_noino())
+		&& k->dev == st->st_dev
+		&& k->ino == st->st_ino
+		&& k->size == st->st_size
+		&& k->nlink == st->st_nlink
+		&& k->mtime.tv_sec == st->st_mtim.tv_sec
+		&& k->mtime.tv_nsec == st->st_mtim.tv_nsec
+		&& k->ctime.tv_sec == st->st_ctim.tv_sec
+		&& k->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+static int rdu_reuse(struct rdu *p, struct stat *st, uint32_t gen, int shwh)
+{
+	return p->key.valid
+		&& p->ent.e
+		&& !p->stream
+		&& rdu_key_match(&p->key, st, gen, shwh);
+}
+
+/*
+ * returns 1 when pos is the end of the dir where getdents(2) dropped the
+ * entries, and the dir and the branches are unchanged since then. the key
+ * is kept by rdu_free() except its valid flag.
+ */
+int rdu_eof(struct rdu *p, unsigned long long pos)
+{
+	int shwh;
+	uint32_t gen;
+	struct stat st;
+
+	return pos
+		&& pos == p->eof
+		&& !fstat(p->fd, &st)
+		&& !rdu_gen(p, &gen, &shwh)
+		&& rdu_key_match(&p->key, &st, gen, shwh);
+}
+
+int rdu_init(struct rdu *p, int want_de)
+{
+	int err, shwh, has_st, has_gen, noino;
+	unsigned long long used, sz, budget;
+	struct aufs_rdu param;
+	struct stat st;
+	uint32_t gen;
+	char *t, *cache;
+	struct au_rdu_ent *e;
+
+	LibAuStatAdd(rdu_init, 1);
+	p->eof = 0;
+	has_st = !fstat(p->fd, &st);
+	cache = NULL;
+	if (has_st)
+		cache = rdu_cache_dir();
+	has_gen = 0;
+	gen = 0;
+	shwh = 0;
+	if (has_st && (p->key.valid || cache))
+		has_gen = !rdu_gen(p, &gen, &shwh);
+	if (has_gen && rdu_reuse(p, &st, gen, shwh)) {
+		LibAuStatAdd(rdu_reuse, 1);
+		err = 0;
+		goto out_de;
+	}
+
+	p->key.valid = 0;
+	if (p->map)
+		rdu_cache_unmap(p);
+	rdu_stream_free(p);
+	p->base = 0;
+	if (cache
+	    && has_gen
+	    && !rdu_cache_load(p, cache, &st, gen, shwh)) {
+		LibAuStatAdd(rdu_cache_hit, 1);
+		rdu_key_set(p, &st, gen, /*noino*/0);
+		err = 0;
+		goto out_de;
+	}
+
+	if (rdu_stream_on()) {
+		err = -1;
+		if (!p->ent.e) {
+			p->sz = RDU_STREAM_SZ;
+			p->ent.e = rdu_pool_get(&p->sz);
+			if (!p->ent.e)
+				goto out;
+		}
+		err = rdu_stream_start(p);
+		goto out_de;
+	}
+
+	if (!p->ent.e) {
+		/*
+		 * the size of the dir, or the previous listing on this fd,
+		 * whichever is larger, is the hint of the initial size.
+		 */
+		if (has_st
+		    && st.st_size > p->sz
+		    && st.st_size <= (1ULL << RDU_POOL_MAX))
+			p->sz = st.st_size;
+		/* but the heap part stays within the budget */
+		budget = rdu_mem();
+		if (budget && p->sz > budget)
+			p->sz = 1ULL << (rdu_pool_order(budget + 1) - 1);
 		err = -1;
-		param.ent.e = malloc(param.sz);
-		if (!param.ent.e)
+		p->ent.e = rdu_pool_get(&p->sz);
+		if (!p->ent.e)
 			goto out;
-		p->ent = param.ent;
 	}
+
+	memset(&param, 0, sizeof(param));
+	param.verify[AufsCtlRduV_SZ] = sizeof(param);
+	param.sz = p->sz;
+	param.ent = p->ent;
+	param.tail = param.ent;
 	t = getenv("AUFS_RDU_BLK");
 	if (t)
-		param.blk = strtoul(t + sizeof("AUFS_RDU_BLK"), NULL, 0);
+		param.blk = strtoul(t, NULL, 0);
 
 	p->npos = 0;
+	if (rdu_pipe_on()) {
+		err = rdu_pipe(p, &param);
+		goto out_merged;
+	}
 	while (1) {
 		param.full = 0;
 		err = rdu_getent(p, &param);
@@ -382,12 +1572,16 @@ int rdu_init(struct rdu *p, int want_de)
 		if (!param.full)
 			continue;
 
+		/* grow geometrically, at least by blk */
 		assert(param.blk);
-		e = realloc(p->ent.e, p->sz + param.blk);
+		sz = p->sz << 1;
+		if (sz < p->sz + param.blk)
+			sz = 1ULL << rdu_pool_order(p->sz + param.blk);
+		e = rdu_ent_grow(p, sz);
 		if (e) {
 			used = param.tail.ul - param.ent.ul;
 			DPri("used %llu\n", used);
-			param.sz += param.blk - used;
+			param.sz += sz - p->sz - used;
 			DPri("sz %llu\n", param.sz);
 			used += param.ent.ul - p->ent.ul;
 			DPri("used %lu\n", used);
@@ -395,7 +1589,7 @@ int rdu_init(struct rdu *p, int want_de)
 			param.ent.ul = p->ent.ul + used;
 			DPri("ent %p\n", param.ent.e);
 			param.tail = param.ent;
-			p->sz += param.blk;
+			p->sz = sz;
 			DPri("sz %llu\n", p->sz);
 		} else {
 			err = -1;
@@ -407,34 +1601,51 @@ int rdu_init(struct rdu *p, int want_de)
 	if (!err)
 		err = rdu_merge(p);
 
-	if (!err) {
+ out_merged:
+	noino = rdu_noino();
+	if (!err && !noino) {
 		param.ent = p->ent;
 		param.nent = p->npos;
 		err = ioctl(p->fd, AUFS_CTL_RDU_INO, &param);
+		LibAuStatAdd(rdu_ino_ioctl, 1);
 	}
 
+	if (!err)
+		err = rdu_de(p);
+	if (!err && has_st)
+		rdu_key_set(p, &st, param.cookie.generation, noino);
+	/* the shared cache has the aufs inode numbers only */
+	if (!err && cache && !noino)
+		rdu_cache_store(p, cache, &st, param.cookie.generation);
+
+ out_de:
 	if (!err && want_de && !p->de) {
 		err = -1;
-		p->de = malloc(sizeof(*p->de));
+		/* the larger one, for both of readdir and readdir64 */
+		p->de = malloc(sizeof(struct dirent64));
 		if (p->de)
 			err = 0;
 	}
 
 	if (err) {
-		free(p->ent.e);
+		if (p->map)
+			rdu_cache_unmap(p);
+		else
+			free(p->ent.e);
 		p->ent.e = NULL;
 #if 0
 	} else {
 		unsigned long long ull;
-		struct au_rdu_ent *e;
+		struct dirent64 *de;
 		for (ull = 0; ull < p->npos; ull++) {
-			e = p->pos[ull];
-			DPri("%p, %.*s\n", e, e->nlen, e->name);
+			de = rdu_pos_de(p, ull);
+			DPri("%p, %s\n", de, de->d_name);
 		}
 #endif
 	}
 
  out:
+	rdu_spill_close(p);
 	return err;
 }
 
@@ -446,22 +1657,20 @@ LibAuDlFunc(closedir);
 int closedir(DIR *dir)
 {
 	int err, fd;
-	struct statfs stfs;
 	struct rdu *p;
 
 	err = -1;
-	if (LibAuTestFunc(Rdu_READDIR)
-	    || LibAuTestFunc(Rdu_READDIR_R)
-	    || LibAuTestFunc(closedir)) {
+	if (LibAuTestMask(LibAuBit(readdir) | LibAuBit(readdir64)
+			  | LibAuBit(readdir_r) | LibAuBit(readdir64_r)
+			  | LibAuBit(closedir))) {
+		LibAuStatCall(closedir);
 		errno = EBADF;
 		fd = dirfd(dir);
 		if (fd < 0)
 			goto out;
-		err = fstatfs(fd, &stfs);
-		if (err)
-			goto out;
 
-		if (stfs.f_type == AUFS_SUPER_MAGIC) {
+		if (rdu_fs_drop(dir, fd)) {
+			LibAuStatAufs(closedir);
 			p = rdu_buf_lock(fd);
 			if (p)
 				rdu_free(p);
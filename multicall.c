@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * A single binary for all the commands in /sbin, like busybox.
+ * The command is chosen by the name of the symlink, or by the first
+ * argument.
+ * Each command is compiled with -Dmain=<name>_main, see Makefile.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "au_util.h"
+
+typedef int (*au_main_t)(int argc, char *argv[]);
+int auibusy_main(int argc, char *argv[]);
+int aumvdown_main(int argc, char *argv[]);
+int auplink_main(int argc, char *argv[]);
+int mount_aufs_main(int argc, char *argv[]);
+int umount_aufs_main(int argc, char *argv[]);
+
+static struct {
+	char		*name;
+	au_main_t	main;
+} cmd[] = {
+	{"auibusy",	auibusy_main},
+	{"aumvdown",	aumvdown_main},
+	{"auplink",	auplink_main},
+	{"mount.aufs",	mount_aufs_main},
+	{"umount.aufs",	umount_aufs_main}
+};
+
+static char *au_basename(char *path)
+{
+	char *p;
+
+	p = strrchr(path, '/');
+	if (p)
+		return p + 1;
+	return path;
+}
+
+static au_main_t au_cmd(char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(cmd) / sizeof(*cmd); i++)
+		if (!strcmp(name, cmd[i].name))
+			return cmd[i].main;
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	char *prog, *name;
+	au_main_t m;
+
+	prog = au_basename(argv[0]);
+	m = au_cmd(prog);
+	if (m)
+		return m(argc, argv);
+
+	if (argc > 1) {
+		name = au_basename(argv[1]);
+		m = au_cmd(name);
+		if (m) {
+			program_invocation_name = argv[1];
+			program_invocation_short_name = name;
+			return m(argc - 1, argv + 1);
+		}
+		fprintf(stderr, "%s: unknown command '%s'\n", prog, argv[1]);
+	}
+
+	fprintf(stderr, "usage: %s command [args ...]\ncommands:", prog);
+	for (i = 0; i < sizeof(cmd) / sizeof(*cmd); i++)
+		fprintf(stderr, " %s", cmd[i].name);
+	fprintf(stderr, "\n" AuVersion "\n");
+	return EINVAL;
+}
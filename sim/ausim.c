@@ -0,0 +1,840 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * ausim, the aufs ioctls in userspace.
+ * it emulates AUFS_CTL_* over the plain directories acting as the branches,
+ * so that libau and the utilities run (and are measured) without the aufs
+ * module. use it as LD_PRELOAD=libausim.so for the dynamically linked ones
+ * (put it before libau.so), or link libausim.a for the static ones
+ * ("make AuSim=yes").
+ *
+ * AUSIM_BR	the branches in the form of aufs "br:" option,
+ *		"/dir0=rw:/dir1=ro+wh:/dir2=rr". the default permission is
+ *		"rw" for the first one and "ro" for the others.
+ * AUSIM_ROOT	the directory treated as the aufs mount point. the files
+ *		under it correspond to the same paths in the branches.
+ *		the default is the first branch.
+ * AUSIM_SHWH	non-zero to behave as the "shwh" mount option is set.
+ *
+ * statfs(2) and fstatfs(2) return AUFS_SUPER_MAGIC under AUSIM_ROOT, and the
+ * aufs ioctls issued to a file under it are handled here. all others are
+ * passed to the kernel.
+ * limitations:
+ * - the directory contents are merged by the ioctls only. AUSIM_ROOT itself
+ *   is a plain directory, and it has to hold the dirs to be opened.
+ * - a whiteout or an opaque dir is honoured only when it is in the
+ *   immediate parent.
+ * - no xino. the inode numbers in the branches are returned as is.
+ * - IBUSY never finds the busy inode.
+ * - FHSM_FD reports each fhsm branch once when it is opened.
+ * - the pseudo-links and /proc/fs/aufs/plink_maint are not emulated.
+ * - 64bit only.
+ */
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/vfs.h>    /* or <sys/statfs.h> */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/aufs_type.h>
+
+/* struct statfs is identical to the one in the kernel */
+#ifndef __LP64__
+#error "ausim supports 64bit only"
+#endif
+
+#define SIM_BR_MAX	127	/* CONFIG_AUFS_BRANCH_MAX_127 */
+#define SIM_GEN		1
+#define SIM_DENTS_SZ	(32 * 1024)
+#define SIM_TMP		AUFS_WH_PFX AUFS_WH_PFX "ausim.XXXXXX"
+
+static struct {
+	char root[PATH_MAX];
+	int root_len, nbr, shwh, fhsm_wfd;
+	struct sim_br {
+		char *path;
+		int perm;
+	} br[SIM_BR_MAX];
+} sim = {
+	.fhsm_wfd = -1
+};
+
+/* ---------------------------------------------------------------------- */
+
+/* the real syscalls, available in both of the shared and static builds */
+
+static int sim_real_ioctl(int fd, unsigned long request, void *arg)
+{
+	return syscall(SYS_ioctl, fd, request, arg);
+}
+
+static int sim_real_statfs(const char *path, struct statfs *buf)
+{
+	return syscall(SYS_statfs, path, buf);
+}
+
+static int sim_real_fstatfs(int fd, struct statfs *buf)
+{
+	return syscall(SYS_fstatfs, fd, buf);
+}
+
+/* ---------------------------------------------------------------------- */
+
+static int sim_perm(char *s)
+{
+	int perm, l, i;
+	char *p;
+	static struct {
+		char *name;
+		int val;
+	} a[] = {
+		{AUFS_BRPERM_RW,	AuBrPerm_RW},
+		{AUFS_BRPERM_RO,	AuBrPerm_RO},
+		{AUFS_BRPERM_RR,	AuBrPerm_RR},
+		{AUFS_BRATTR_FHSM,	AuBrAttr_FHSM},
+		{AUFS_BRRATTR_WH,	AuBrRAttr_WH},
+		{AUFS_BRWATTR_NLWH,	AuBrWAttr_NoLinkWH},
+		{AUFS_BRWATTR_MOO,	AuBrWAttr_MOO},
+		{AUFS_BRATTR_COO_REG,	AuBrAttr_COO_REG},
+		{AUFS_BRATTR_COO_ALL,	AuBrAttr_COO_ALL}
+	};
+
+	perm = 0;
+	while (*s) {
+		p = strchrnul(s, '+');
+		l = p - s;
+		for (i = 0; i < sizeof(a) / sizeof(*a); i++)
+			if (strlen(a[i].name) == l && !strncmp(s, a[i].name, l)) {
+				perm |= a[i].val;
+				break;
+			}
+		s = p;
+		if (*s)
+			s++;
+	}
+	return perm;
+}
+
+static void __attribute__((constructor)) sim_init(void)
+{
+	int nbr;
+	char *env, *s, *perm, *p;
+
+	env = getenv("AUSIM_SHWH");
+	sim.shwh = env && atoi(env);
+	env = getenv("AUSIM_BR");
+	if (!env || !*env)
+		return;
+
+	env = strdup(env);
+	if (!env)
+		goto out;
+	nbr = 0;
+	for (s = strtok_r(env, ":", &p); s; s = strtok_r(NULL, ":", &p)) {
+		if (nbr == SIM_BR_MAX)
+			goto out;
+		perm = strchr(s, '=');
+		if (perm)
+			*perm++ = '\0';
+		sim.br[nbr].path = realpath(s, NULL);
+		if (!sim.br[nbr].path)
+			goto out;
+		if (perm)
+			sim.br[nbr].perm = sim_perm(perm);
+		if (!(sim.br[nbr].perm & AuBrPerm_Mask))
+			sim.br[nbr].perm |= nbr ? AuBrPerm_RO : AuBrPerm_RW;
+		nbr++;
+	}
+	if (!nbr)
+		goto out;
+
+	env = getenv("AUSIM_ROOT");
+	if (!env || !*env)
+		env = sim.br[0].path;
+	if (!realpath(env, sim.root))
+		goto out;
+	sim.root_len = strlen(sim.root);
+	if (sim.root_len == 1)
+		sim.root_len = 0;
+	sim.nbr = nbr;
+	return;
+
+out:
+	fprintf(stderr, "ausim: invalid AUSIM_BR or AUSIM_ROOT, %m\n");
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* store the relative path from AUSIM_ROOT, returns -1 when it is outside */
+static int sim_rel(char *path, char *rel)
+{
+	int l;
+
+	if (strncmp(path, sim.root, sim.root_len)
+	    || (path[sim.root_len] && path[sim.root_len] != '/'))
+		return -1;
+	path += sim.root_len;
+	while (*path == '/')
+		path++;
+	l = strlen(path);
+	memmove(rel, path, l + 1);
+	return 0;
+}
+
+static int sim_rel_fd(int fd, char *rel)
+{
+	ssize_t ssz;
+	char proc[32];
+
+	if (!sim.nbr)
+		return -1;
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	ssz = readlink(proc, rel, PATH_MAX - 1);
+	if (ssz <= 0 || *rel != '/')
+		return -1;
+	rel[ssz] = '\0';
+	return sim_rel(rel, rel);
+}
+
+static int sim_rel_path(const char *path, char *rel)
+{
+	if (!sim.nbr || !realpath(path, rel))
+		return -1;
+	return sim_rel(rel, rel);
+}
+
+/* br/rel, or br/dirname(rel)/pfx+basename(rel) when pfx is given */
+static int sim_path(char *path, int bindex, char *rel, char *pfx)
+{
+	int l;
+	char *base;
+
+	if (!pfx)
+		l = snprintf(path, PATH_MAX, "%s%s%s", sim.br[bindex].path,
+			     *rel ? "/" : "", rel);
+	else {
+		base = strrchr(rel, '/');
+		if (base)
+			l = snprintf(path, PATH_MAX, "%s/%.*s/%s%s",
+				     sim.br[bindex].path, (int)(base - rel),
+				     rel, pfx, base + 1);
+		else
+			l = snprintf(path, PATH_MAX, "%s/%s%s",
+				     sim.br[bindex].path, pfx, rel);
+	}
+	if (l < 0 || l >= PATH_MAX) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int sim_exist(int bindex, char *rel, char *pfx, struct stat *st)
+{
+	char path[PATH_MAX];
+	struct stat tmp;
+
+	if (!st)
+		st = &tmp;
+	return !sim_path(path, bindex, rel, pfx) && !lstat(path, st);
+}
+
+/* whether rel is whiteout-ed in the branch */
+static int sim_wh(int bindex, char *rel)
+{
+	return *rel && sim_exist(bindex, rel, AUFS_WH_PFX, NULL);
+}
+
+/* whether the dir rel is opaque in the branch */
+static int sim_opq(int bindex, char *rel)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (sim_path(path, bindex, rel, NULL)
+	    || strlen(path) + sizeof(AUFS_WH_DIROPQ) + 1 > PATH_MAX)
+		return 0;
+	strcat(path, "/" AUFS_WH_DIROPQ);
+	return !lstat(path, &st);
+}
+
+/* the lowest branch which may hold the entries of the dir rel */
+static int sim_dir_bbot(char *rel)
+{
+	int bindex;
+	struct stat st;
+
+	for (bindex = 0; bindex < sim.nbr; bindex++) {
+		if (sim_exist(bindex, rel, NULL, &st)
+		    && (!S_ISDIR(st.st_mode) || sim_opq(bindex, rel)))
+			break;
+		if (sim_wh(bindex, rel))
+			break;
+	}
+	if (bindex == sim.nbr)
+		bindex--;
+	return bindex;
+}
+
+/* the top branch which has rel, searching from btop */
+static int sim_lookup(int btop, char *rel)
+{
+	int bindex;
+
+	for (bindex = btop; bindex < sim.nbr; bindex++) {
+		if (sim_exist(bindex, rel, NULL, NULL))
+			return bindex;
+		if (sim_wh(bindex, rel))
+			break;
+	}
+	return -1;
+}
+
+static int sim_writable(int bindex)
+{
+	return au_br_writable(sim.br[bindex].perm);
+}
+
+static int sim_stfs(int bindex, struct aufs_stfs *stfs)
+{
+	int err;
+	struct statfs st;
+
+	err = sim_real_statfs(sim.br[bindex].path, &st);
+	if (!err) {
+		stfs->f_blocks = st.f_blocks;
+		stfs->f_bavail = st.f_bavail;
+		stfs->f_files = st.f_files;
+		stfs->f_ffree = st.f_ffree;
+	}
+	return err;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * AUFS_CTL_RDU.
+ * the entries are read by getdents64(2) from the position in the cookie, and
+ * the position of the entry which didn't fit is stored for the next call.
+ */
+static int sim_rdu_br(int fd, struct aufs_rdu *rdu, uint64_t end)
+{
+	int nlen, len, wh;
+	ssize_t ssz, off;
+	char buf[SIM_DENTS_SZ] __attribute__((aligned(8))), *name;
+	struct dirent64 *de;
+	struct au_rdu_ent *e;
+	struct au_rdu_cookie *cookie = &rdu->cookie;
+
+	if (lseek(fd, cookie->h_pos, SEEK_SET) == -1)
+		return -1;
+	while ((ssz = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+		for (off = 0; off < ssz; off += de->d_reclen) {
+			de = (void *)(buf + off);
+			name = de->d_name;
+			nlen = strlen(name);
+			wh = 0;
+			/* doubly whiteouted ones are always hidden */
+			if (!strncmp(name, AUFS_WH_PFX AUFS_WH_PFX,
+				     AUFS_WH_PFX_LEN * 2))
+				goto next;
+			/* the name keeps the prefix */
+			wh = nlen > AUFS_WH_PFX_LEN
+				&& !memcmp(name, AUFS_WH_PFX, AUFS_WH_PFX_LEN);
+			len = au_rdu_len(nlen);
+			if (end - rdu->tail.ul < len) {
+				rdu->full = 1;
+				return 0;
+			}
+			e = (void *)(unsigned long)rdu->tail.ul;
+			e->ino = de->d_ino;
+			e->bindex = cookie->bindex;
+			e->type = de->d_type;
+			e->nlen = nlen;
+			e->wh = wh;
+			memcpy(e->name, name, nlen);
+			e->name[nlen] = '\0';
+			rdu->tail.ul += len;
+			rdu->rent++;
+		next:
+			cookie->h_pos = de->d_off;
+		}
+	return ssz;
+}
+
+static int sim_rdu(char *rel, struct aufs_rdu *rdu)
+{
+	int err, fd, bbot;
+	char path[PATH_MAX];
+	struct au_rdu_cookie *cookie = &rdu->cookie;
+
+	errno = EINVAL;
+	if (rdu->verify[AufsCtlRduV_SZ] != sizeof(*rdu))
+		return -1;
+	if (!rdu->blk)
+		rdu->blk = au_rdu_len(NAME_MAX) > 4096 ? au_rdu_len(NAME_MAX)
+			: 4096;
+
+	err = 0;
+	rdu->rent = 0;
+	rdu->full = 0;
+	rdu->shwh = sim.shwh;
+	rdu->tail = rdu->ent;
+	bbot = sim_dir_bbot(rel);
+	for (; cookie->bindex <= bbot; cookie->bindex++, cookie->h_pos = 0) {
+		if (cookie->bindex < 0)
+			break;
+		err = sim_path(path, cookie->bindex, rel, NULL);
+		if (err)
+			break;
+		fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		err = sim_rdu_br(fd, rdu, rdu->ent.ul + rdu->sz);
+		close(fd);
+		if (err || rdu->full)
+			break;
+	}
+	cookie->generation = SIM_GEN;
+	return err;
+}
+
+/* AUFS_CTL_RDU_INO, the xino is identical */
+static int sim_rdu_ino(struct aufs_rdu *rdu)
+{
+	uint64_t ul;
+	union au_rdu_ent_ul u;
+	struct au_rdu_ent *e;
+
+	errno = EINVAL;
+	if (rdu->verify[AufsCtlRduV_SZ] != sizeof(*rdu))
+		return -1;
+
+	u = rdu->ent;
+	for (ul = 0; ul < rdu->nent; ul++) {
+		e = (void *)(unsigned long)u.ul;
+		if (e->bindex < 0 || e->bindex >= sim.nbr)
+			return -1;
+		u.ul += au_rdu_len(e->nlen);
+	}
+	return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+static int sim_brinfo(union aufs_brinfo *brinfo)
+{
+	int bindex;
+
+	if (!brinfo)
+		return sim.nbr;
+
+	for (bindex = 0; bindex < sim.nbr; bindex++, brinfo++) {
+		if (strlen(sim.br[bindex].path) + 1
+		    > sizeof(*brinfo) - offsetof(union aufs_brinfo, path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		brinfo->id = bindex;
+		brinfo->perm = sim.br[bindex].perm;
+		strcpy(brinfo->path, sim.br[bindex].path);
+	}
+	return 0;
+}
+
+static int sim_wbr_fd(struct aufs_wbr_fd *arg)
+{
+	int bindex;
+	struct aufs_wbr_fd wbrfd;
+	const int valid = O_RDONLY | O_NONBLOCK | O_LARGEFILE | O_DIRECTORY
+		| O_NOATIME | O_CLOEXEC;
+
+	wbrfd.oflags = 0;
+	wbrfd.brid = -1;
+	if (arg)
+		wbrfd = *arg;
+	errno = EINVAL;
+	if (wbrfd.oflags & ~valid)
+		return -1;
+
+	if (wbrfd.brid >= 0) {
+		bindex = wbrfd.brid;
+		if (bindex >= sim.nbr)
+			return -1;
+	} else {
+		for (bindex = 0; bindex < sim.nbr; bindex++)
+			if (sim_writable(bindex))
+				break;
+		errno = EROFS;
+		if (bindex == sim.nbr)
+			return -1;
+	}
+	return open(sim.br[bindex].path,
+		    wbrfd.oflags | O_RDONLY | O_DIRECTORY);
+}
+
+static int sim_ibusy(struct aufs_ibusy *ibusy)
+{
+	if (ibusy->bindex < 0 || ibusy->bindex >= sim.nbr) {
+		errno = EINVAL;
+		return -1;
+	}
+	ibusy->h_ino = 0;
+	return 0;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/* the branch to move-down to, from the one under the upper */
+static int sim_mvd_lower(int upper, int flags)
+{
+	int bindex;
+
+	for (bindex = upper + 1; bindex < sim.nbr; bindex++)
+		if ((sim_writable(bindex) || (flags & AUFS_MVDOWN_ROLOWER))
+		    && (!(flags & AUFS_MVDOWN_FHSM_LOWER)
+			|| au_br_fhsm(sim.br[bindex].perm)))
+			return bindex;
+	return -1;
+}
+
+static int sim_mkdir_p(int upper, int lower, char *rel)
+{
+	int err;
+	char *p, path[PATH_MAX];
+	struct stat st;
+
+	err = 0;
+	for (p = strchr(rel, '/'); !err && p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		st.st_mode = 0755;
+		sim_exist(upper, rel, NULL, &st);
+		err = sim_path(path, lower, rel, NULL);
+		if (!err && mkdir(path, st.st_mode & 07777) && errno != EEXIST)
+			err = -1;
+		*p = '/';
+	}
+	return err;
+}
+
+/* copy the file from the upper to the lower, replacing it atomically */
+static int sim_cpdown(int upper, int lower, char *rel)
+{
+	int err, src, dst, l;
+	ssize_t ssz;
+	char path[PATH_MAX], tmp[PATH_MAX], buf[64 * 1024], *p;
+	struct stat st;
+	struct timespec ts[2];
+
+	err = sim_mkdir_p(upper, lower, rel);
+	if (err)
+		goto out;
+	err = sim_path(path, upper, rel, NULL);
+	if (err)
+		goto out;
+	src = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src < 0) {
+		err = -1;
+		goto out;
+	}
+	err = sim_path(path, lower, rel, NULL);
+	if (err)
+		goto out_src;
+	p = strrchr(path, '/');
+	l = snprintf(tmp, sizeof(tmp), "%.*s/" SIM_TMP, (int)(p - path), path);
+	err = -1;
+	errno = ENAMETOOLONG;
+	if (l < 0 || l >= sizeof(tmp))
+		goto out_src;
+	dst = mkstemp(tmp);
+	if (dst < 0)
+		goto out_src;
+
+	while ((ssz = read(src, buf, sizeof(buf))) > 0)
+		if (write(dst, buf, ssz) != ssz) {
+			ssz = -1;
+			break;
+		}
+	if (!ssz && !fstat(src, &st)) {
+		ts[0] = st.st_atim;
+		ts[1] = st.st_mtim;
+		if (fchown(dst, st.st_uid, st.st_gid))
+			; /* ignore */
+		if (!fchmod(dst, st.st_mode & 07777)
+		    && !futimens(dst, ts))
+			err = 0;
+	}
+	if (close(dst))
+		err = -1;
+	if (!err)
+		err = rename(tmp, path);
+	if (err)
+		unlink(tmp);
+
+out_src:
+	close(src);
+out:
+	return err;
+}
+
+static int sim_mvdown(int fd, char *rel, struct aufs_mvdown *mvdown)
+{
+	int err, top, upper, lower, bindex, flags;
+	char parent[PATH_MAX], *p;
+	struct stat st;
+
+	mvdown->au_errno = 0;
+	flags = mvdown->flags;
+	mvdown->flags &= ~(AUFS_MVDOWN_ROLOWER_R | AUFS_MVDOWN_ROUPPER_R
+			   | AUFS_MVDOWN_STFS_FAILED | AUFS_MVDOWN_BOTTOM);
+	err = fstat(fd, &st);
+	if (err)
+		goto out;
+	err = -1;
+	errno = EISDIR;
+	if (S_ISDIR(st.st_mode))
+		goto out;
+	errno = EINVAL;
+	if (!S_ISREG(st.st_mode) || !*rel)
+		goto out;
+
+	errno = ENOENT;
+	top = sim_lookup(0, rel);
+	if (top < 0)
+		goto out;
+	upper = top;
+	errno = EINVAL;
+	if (flags & AUFS_MVDOWN_BRID_UPPER) {
+		upper = mvdown->stbr[AUFS_MVDOWN_UPPER].brid;
+		if (upper < 0 || upper >= sim.nbr)
+			goto out;
+		if (top < upper) {
+			mvdown->au_errno = EAU_MVDOWN_UPPER;
+			goto out;
+		}
+		if (top > upper || !sim_exist(upper, rel, NULL, NULL)) {
+			mvdown->au_errno = EAU_MVDOWN_NOUPPER;
+			goto out;
+		}
+	}
+
+	if (flags & AUFS_MVDOWN_BRID_LOWER) {
+		lower = mvdown->stbr[AUFS_MVDOWN_LOWER].brid;
+		if (lower <= upper || lower >= sim.nbr) {
+			mvdown->au_errno = EAU_MVDOWN_NOLOWERBR;
+			goto out;
+		}
+	} else {
+		lower = sim_mvd_lower(upper, flags);
+		if (lower < 0) {
+			mvdown->au_errno = EAU_MVDOWN_BOTTOM;
+			goto out;
+		}
+	}
+	errno = EROFS;
+	if ((!sim_writable(upper) && !(flags & AUFS_MVDOWN_ROUPPER))
+	    || (!sim_writable(lower) && !(flags & AUFS_MVDOWN_ROLOWER)))
+		goto out;
+
+	/* the parent dir */
+	strcpy(parent, rel);
+	p = strrchr(parent, '/');
+	if (p)
+		*p = '\0';
+	else
+		*parent = '\0';
+	errno = EINVAL;
+	for (bindex = upper; bindex < lower; bindex++)
+		if (sim_opq(bindex, parent)) {
+			mvdown->au_errno = EAU_MVDOWN_OPAQUE;
+			goto out;
+		}
+	for (bindex = upper + 1; bindex <= lower; bindex++)
+		if (sim_wh(bindex, parent)) {
+			mvdown->au_errno = EAU_MVDOWN_WHITEOUT;
+			goto out;
+		}
+	errno = EEXIST;
+	if (!(flags & AUFS_MVDOWN_OWLOWER) && sim_exist(lower, rel, NULL, NULL))
+		goto out;
+
+	err = sim_cpdown(upper, lower, rel);
+	if (!err && !(flags & AUFS_MVDOWN_KUPPER)) {
+		err = sim_path(parent, upper, rel, NULL);
+		if (!err)
+			err = unlink(parent);
+	}
+	if (err)
+		goto out;
+
+	mvdown->stbr[AUFS_MVDOWN_UPPER].brid = upper;
+	mvdown->stbr[AUFS_MVDOWN_UPPER].bindex = upper;
+	mvdown->stbr[AUFS_MVDOWN_LOWER].brid = lower;
+	mvdown->stbr[AUFS_MVDOWN_LOWER].bindex = lower;
+	if (!sim_writable(upper))
+		mvdown->flags |= AUFS_MVDOWN_ROUPPER_R;
+	if (!sim_writable(lower))
+		mvdown->flags |= AUFS_MVDOWN_ROLOWER_R;
+	if (sim_mvd_lower(lower, flags) < 0)
+		mvdown->flags |= AUFS_MVDOWN_BOTTOM;
+	if ((flags & AUFS_MVDOWN_STFS)
+	    && (sim_stfs(upper, &mvdown->stbr[AUFS_MVDOWN_UPPER].stfs)
+		|| sim_stfs(lower, &mvdown->stbr[AUFS_MVDOWN_LOWER].stfs)))
+		mvdown->flags |= AUFS_MVDOWN_STFS_FAILED;
+
+out:
+	return err;
+}
+
+/* ---------------------------------------------------------------------- */
+
+/*
+ * AUFS_CTL_FHSM_FD.
+ * a pipe which carries struct aufs_stbr of every fhsm branch once. only one
+ * reader is allowed at a time, as the kernel does.
+ */
+static int sim_fhsm_fd(int oflags)
+{
+	int fd[2], bindex, nfhsm;
+	struct aufs_stbr stbr;
+	struct pollfd pfd;
+
+	errno = EINVAL;
+	if (oflags & ~(O_CLOEXEC | O_NONBLOCK))
+		return -1;
+	nfhsm = 0;
+	for (bindex = 0; bindex < sim.nbr; bindex++)
+		if (au_br_fhsm(sim.br[bindex].perm))
+			nfhsm++;
+	errno = EOPNOTSUPP;
+	if (nfhsm < 2)
+		return -1;
+
+	if (sim.fhsm_wfd >= 0) {
+		/* the previous reader has gone? */
+		pfd.fd = sim.fhsm_wfd;
+		pfd.events = POLLOUT;
+		errno = EBUSY;
+		if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLERR))
+			return -1;
+		close(sim.fhsm_wfd);
+		sim.fhsm_wfd = -1;
+	}
+
+	if (pipe2(fd, oflags))
+		return -1;
+	for (bindex = 0; bindex < sim.nbr; bindex++) {
+		if (!au_br_fhsm(sim.br[bindex].perm))
+			continue;
+		memset(&stbr, 0, sizeof(stbr));
+		stbr.brid = bindex;
+		stbr.bindex = bindex;
+		if (sim_stfs(bindex, &stbr.stfs)
+		    || write(fd[1], &stbr, sizeof(stbr)) != sizeof(stbr)) {
+			close(fd[0]);
+			close(fd[1]);
+			return -1;
+		}
+	}
+	fcntl(fd[1], F_SETFD, FD_CLOEXEC);
+	sim.fhsm_wfd = fd[1];
+	return fd[0];
+}
+
+/* ---------------------------------------------------------------------- */
+
+#ifdef __GLIBC__
+int ioctl(int fd, unsigned long request, ...)
+#else
+int ioctl(int fd, int request, ...)
+#endif
+{
+	void *arg;
+	char rel[PATH_MAX];
+	va_list ap;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (_IOC_TYPE(request) != AuCtlType || sim_rel_fd(fd, rel))
+		return sim_real_ioctl(fd, request, arg);
+
+	switch (request) {
+	case AUFS_CTL_RDU:
+		return sim_rdu(rel, arg);
+	case AUFS_CTL_RDU_INO:
+		return sim_rdu_ino(arg);
+	case AUFS_CTL_WBR_FD:
+		return sim_wbr_fd(arg);
+	case AUFS_CTL_IBUSY:
+		return sim_ibusy(arg);
+	case AUFS_CTL_MVDOWN:
+		return sim_mvdown(fd, rel, arg);
+	case AUFS_CTL_BRINFO:
+		return sim_brinfo(arg);
+	case AUFS_CTL_FHSM_FD:
+		return sim_fhsm_fd((int)(long)arg);
+	}
+	return sim_real_ioctl(fd, request, arg);
+}
+
+int fstatfs(int fd, struct statfs *buf)
+{
+	int err;
+	char rel[PATH_MAX];
+
+	err = sim_real_fstatfs(fd, buf);
+	if (!err && !sim_rel_fd(fd, rel))
+		buf->f_type = AUFS_SUPER_MAGIC;
+	return err;
+}
+
+int statfs(const char *path, struct statfs *buf)
+{
+	int err;
+	char rel[PATH_MAX];
+
+	err = sim_real_statfs(path, buf);
+	if (!err && !sim_rel_path(path, rel))
+		buf->f_type = AUFS_SUPER_MAGIC;
+	return err;
+}
+
+int fstatfs64(int fd, struct statfs64 *buf)
+{
+	return fstatfs(fd, (void *)buf);
+}
+
+int statfs64(const char *path, struct statfs64 *buf)
+{
+	return statfs(path, (void *)buf);
+}
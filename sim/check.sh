@@ -0,0 +1,171 @@
+#!/bin/sh -
+
+# Copyright (C) 2016 Junjiro R. Okajima
+#
+# This program, aufs is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program; if not, write to the Free Software
+# Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+
+# the behaviour test of libau over ausim, run by "make check".
+# three branches are created in a temporary dir, holding the duplicated
+# names, the whiteouts and an opaque dir. ls(1), find(1) and lsdir, which
+# lists by each entry point of libau, run with LD_PRELOAD in each mode of
+# libau, and their output is compared with the merged listing computed here
+# by the aufs rules.
+# usage: check.sh libausim.so libau.so lsdir
+
+set -eu
+Sim=$(readlink -f $1)
+LibAu=$(readlink -f $2)
+LsDir=$(readlink -f $3)
+N=${CHECK_N:-3000}
+
+Root=$(mktemp -d /tmp/libau_check.XXXXXX)
+trap 'rm -rf $Root' EXIT
+B0=$Root/b0
+B1=$Root/b1
+B2=$Root/b2
+Cache=$Root/cache
+Exp=$Root/exp
+
+# the names in the lower branch come in the order of the number, so that
+# the merged listing is long enough to cross the ioctl blocks
+mkdir -p $B0/d/o $B0/d/s $B1/d/o $B1/d/s $B2/d/o $B2/d/s $Cache
+(
+	cd $B1/d
+	seq 1 $N | sed 's/^/f/' | xargs touch
+	seq 1 $N | awk '$1 % 5 == 0 {print ".wh.l" $1}' | xargs touch
+	seq 1 20 | sed 's/^/o\/o/' | xargs touch
+	touch o/.wh..wh..opq
+	mkdir s/s1
+)
+(
+	cd $B2/d
+	seq 1 $N | sed 's/^/l/' | xargs touch
+	seq 1 300 | sed 's/^/u/' | xargs touch
+	seq 1 20 | sed 's/^/o\/hidden/' | xargs touch
+	seq 1 20 | sed 's/^/s\/s/' | xargs touch
+)
+(
+	cd $B0/d
+	seq 1 $N | awk '$1 % 7 == 0 {print ".wh.f" $1}' | xargs touch
+	seq 1 300 | sed 's/^/u/' | xargs touch
+	touch o/o1 o/o100 s/s1 s/s100
+)
+# libau doesn't cache the dir modified within 2 seconds
+sleep 2
+
+# the merged names of a dir, "." and ".." included
+merged() # dir
+{
+	for i in 0 1 2
+	do
+		d=$Root/b$i/$1
+		test -d $d || continue
+		ls -a $d | sed "s/^/$i /"
+		test -e $d/.wh..wh..opq && break
+	done |
+	awk '
+	$2 ~ /^\.wh\.\.wh\./ {next}
+	$2 ~ /^\.wh\./ {wh[substr($2, 5)] = 1; next}
+	($2 in wh) || ($2 in seen) {next}
+	{seen[$2] = 1; print $2}
+	' |
+	sort
+}
+
+for i in d d/o d/s
+do merged $i > $Exp.$(echo $i | tr / _)
+done
+(
+	echo $B0/d
+	for i in d d/o d/s
+	do grep -Fvx -e . -e .. $Exp.$(echo $i | tr / _) | sed "s:^:$B0/$i/:"
+	done
+) | sort -u > $Exp.find
+
+Err=0
+run() # env...
+{
+	ok=ok
+	for i in d d/o d/s
+	do
+		if ! env "$@" LIBAU=all AUSIM_BR=$B0=rw:$B1=ro:$B2=ro \
+			LD_PRELOAD="$Sim $LibAu" ls -af $B0/$i |
+			sort |
+			cmp -s - $Exp.$(echo $i | tr / _)
+		then
+			echo FAIL ls $i "$@"
+			ok=FAIL
+		fi
+	done
+	if ! env "$@" LIBAU=all AUSIM_BR=$B0=rw:$B1=ro:$B2=ro \
+		LD_PRELOAD="$Sim $LibAu" find $B0/d |
+		sort |
+		cmp -s - $Exp.find
+	then
+		echo FAIL find "$@"
+		ok=FAIL
+	fi
+	for i in readdir rewind getdents64 getdirentries scandir
+	do
+		if ! env "$@" LIBAU=all AUSIM_BR=$B0=rw:$B1=ro:$B2=ro \
+			LD_PRELOAD="$Sim $LibAu" $LsDir $i $B0/d |
+			sort |
+			cmp -s - $Exp.d
+		then
+			echo FAIL lsdir $i "$@"
+			ok=FAIL
+		fi
+	done
+	echo $ok "$@"
+	test $ok = ok || Err=1
+}
+
+run LIBAU_RDU_DEFAULT=1
+run LIBAU_RDU_STREAM=1
+run AUFS_RDU_BLK=256
+run LIBAU_RDU_NOINO=all
+run LIBAU_RDU_PIPE=1
+run LIBAU_RDU_PIPE=1 AUFS_RDU_BLK=256
+run LIBAU_RDU_MEM=16k
+run LIBAU_RDU_MEM=16k AUFS_RDU_BLK=256
+run LIBAU_RDU_MEM=16k LIBAU_RDU_SPILL=/nonexistent
+# the first one stores, and the second one loads
+run LIBAU_RDU_CACHE=$Cache
+run LIBAU_RDU_CACHE=$Cache LIBAU_STAT=$Root/stat
+if ! grep -q '"rdu_cache_hit":[1-9]' $Root/stat
+then
+	echo FAIL no cache hit
+	Err=1
+fi
+
+# rewinddir(3) reuses the entries of the unchanged dir
+LIBAU=all AUSIM_BR=$B0=rw:$B1=ro:$B2=ro LIBAU_STAT=$Root/stat.rewind \
+	LD_PRELOAD="$Sim $LibAu" $LsDir rewind $B0/d > /dev/null
+if ! grep -q '"rdu_reuse":[1-9]' $Root/stat.rewind
+then
+	echo FAIL no reuse by rewinddir
+	Err=1
+fi
+
+# polling a bare fd at the end of the dir doesn't list it again
+LIBAU=all AUSIM_BR=$B0=rw:$B1=ro:$B2=ro LIBAU_STAT=$Root/stat.eof \
+	LD_PRELOAD="$Sim $LibAu" $LsDir getdents64 $B0/d > /dev/null
+if ! grep -q '"rdu_init":1,' $Root/stat.eof
+then
+	echo FAIL getdents64 lists again at the end
+	Err=1
+fi
+
+exit $Err
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2016 Junjiro R. Okajima
+ *
+ * This program, aufs is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * print the names in a dir one by one, by the entry point of libau given
+ * as the first argument, for check.sh. never installed.
+ * readdir		opendir(3) and readdir(3)
+ * rewind		readdir(3) twice with rewinddir(3), print the second
+ * getdents64		getdents64(2) on a bare fd, and poll it at the end
+ * getdirentries	getdirentries(3) on a bare fd
+ * scandir		scandir(3)
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LSDIR_POLL	10
+
+static int ls_readdir(char *path, int rewind)
+{
+	int err;
+	DIR *dp;
+	struct dirent *de;
+
+	err = -1;
+	dp = opendir(path);
+	if (!dp)
+		goto out;
+	if (rewind) {
+		while (readdir(dp))
+			;
+		rewinddir(dp);
+	}
+	errno = 0;
+	while ((de = readdir(dp)))
+		puts(de->d_name);
+	err = errno ? -1 : 0;
+	closedir(dp);
+
+ out:
+	return err;
+}
+
+static int ls_bare(char *path, int gde)
+{
+	int err, fd, i;
+	ssize_t ssz, off;
+	off_t base;
+	char buf[4096] __attribute__((aligned(8)));
+	struct dirent64 *de;
+
+	err = -1;
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		goto out;
+	while (1) {
+		if (gde)
+			ssz = getdirentries(fd, buf, sizeof(buf), &base);
+		else
+			ssz = getdents64(fd, buf, sizeof(buf));
+		if (ssz <= 0)
+			break;
+		for (off = 0; off < ssz; off += de->d_reclen) {
+			de = (void *)(buf + off);
+			puts(de->d_name);
+		}
+	}
+	if (ssz)
+		goto out_close;
+
+	/* staying at the end of the dir gets nothing */
+	for (i = 0; !gde && i < LSDIR_POLL; i++) {
+		ssz = getdents64(fd, buf, sizeof(buf));
+		if (ssz) {
+			fprintf(stderr, "%s: %zd at the end\n", path, ssz);
+			goto out_close;
+		}
+	}
+	err = 0;
+
+ out_close:
+	close(fd);
+ out:
+	return err;
+}
+
+static int ls_scandir(char *path)
+{
+	int n, i;
+	struct dirent **de;
+
+	n = scandir(path, &de, NULL, NULL);
+	for (i = 0; i < n; i++) {
+		puts(de[i]->d_name);
+		free(de[i]);
+	}
+	if (n >= 0)
+		free(de);
+	return n < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int err;
+
+	err = -1;
+	errno = EINVAL;
+	if (argc != 3)
+		goto out;
+	if (!strcmp(argv[1], "readdir"))
+		err = ls_readdir(argv[2], /*rewind*/0);
+	else if (!strcmp(argv[1], "rewind"))
+		err = ls_readdir(argv[2], /*rewind*/1);
+	else if (!strcmp(argv[1], "getdents64"))
+		err = ls_bare(argv[2], /*gde*/0);
+	else if (!strcmp(argv[1], "getdirentries"))
+		err = ls_bare(argv[2], /*gde*/1);
+	else if (!strcmp(argv[1], "scandir"))
+		err = ls_scandir(argv[2]);
+
+ out:
+	if (err)
+		perror(argv[argc - 1]);
+	return !!err;
+}